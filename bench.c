@@ -0,0 +1,416 @@
+// Benchmark of the decode -> convert -> present hot path, on a fixed corpus of synthetic JPEGs
+// rendered to the headless screen backend. Prints one JSON object per line, for each image,
+// decode profile, pixel format and stage, so results can be diffed across commits:
+//   {"image":"baseline_color_1600x1200","profile":"fast","bpp":32,"stage":"decode",...}
+// and the time to draw and present one frame of each full screen transition:
+//   {"transition":"crossfade","bpp":32,"threads":2,"stage":"frame",...}
+// and how decoding JPEGs with restart markers in stripes scales with threads:
+//   {"image":"baseline_color_rst_1600x1200","threads":2,"stage":"stripes",...}
+//
+// Stripe decodes are also checked against a serial decode of the same image: any difference fails
+// the bench, with a non-zero exit.
+//
+// Usage: picrt-bench [iterations]
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <jpeglib.h>
+
+#include "gray_conv.h"
+#include "jpeg_decode.h"
+#include "jpeg_stripes.h"
+#include "screen_mem.h"
+#include "transition.h"
+#include "worker_pool.h"
+
+#define GAMMA .15
+#define SCREEN_W 720
+#define SCREEN_H 576
+
+struct corpus_img {
+    char name[64];
+    unsigned char* data;
+    unsigned long sz;
+};
+
+enum stage {
+    STAGE_HEADER,
+    STAGE_DECODE,
+    STAGE_CONVERT,
+    STAGE_WRITE,
+    STAGE_FLIP,
+    STAGE_TOTAL,
+    STAGE_COUNT,
+};
+
+static const char* stage_names[STAGE_COUNT] = {
+    "header", "decode", "convert", "write", "flip", "total",
+};
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Deterministic content with gradients, edges and noise, so the encoder can't cheat
+static void fill_row(unsigned char* row, int w, int h, int y, int components, unsigned* seed) {
+    for (int x = 0; x < w; x++) {
+        *seed = *seed * 1103515245u + 12345u;
+        int noise = (*seed >> 16) & 0x1F;
+        int edge = ((x / 64) ^ (y / 64)) & 1 ? 64 : 0;
+        unsigned char r = (x * 191 / w + edge + noise) & 0xFF;
+        unsigned char g = (y * 191 / h + noise) & 0xFF;
+        unsigned char b = ((x + y) * 127 / (w + h) + edge) & 0xFF;
+        if (components == 1) {
+            row[x] = (r + g + b) / 3;
+        } else {
+            row[3 * x] = r;
+            row[3 * x + 1] = g;
+            row[3 * x + 2] = b;
+        }
+    }
+}
+
+// restart_rows adds a restart marker every that many rows of MCUs, 0 for none
+static bool make_jpeg(struct corpus_img* img, int w, int h, bool color, bool progressive,
+                      int restart_rows) {
+    snprintf(img->name, sizeof(img->name), "%s_%s%s_%dx%d",
+             progressive ? "progressive" : "baseline", color ? "color" : "gray",
+             restart_rows ? "_rst" : "", w, h);
+
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+
+    img->data = NULL;
+    img->sz = 0;
+    jpeg_mem_dest(&cinfo, &img->data, &img->sz);
+
+    const int components = color ? 3 : 1;
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = components;
+    cinfo.in_color_space = color ? JCS_RGB : JCS_GRAYSCALE;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    if (progressive) {
+        jpeg_simple_progression(&cinfo);
+    }
+    cinfo.restart_in_rows = restart_rows;
+
+    unsigned char* row = malloc((size_t)w * components);
+    if (!row) {
+        jpeg_destroy_compress(&cinfo);
+        return false;
+    }
+
+    unsigned seed = 42;
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        fill_row(row, w, h, cinfo.next_scanline, components, &seed);
+        JSAMPROW rp = row;
+        jpeg_write_scanlines(&cinfo, &rp, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(row);
+    return true;
+}
+
+// Runs one image through the same steps as picrt's reveal, minus the scanline delay
+static void render_once(struct screen* s, struct jpeg_decoder* dec, const struct gray_conv* conv,
+                        unsigned char* gray, const struct corpus_img* img, double t[STAGE_COUNT]) {
+    memset(t, 0, sizeof(double) * STAGE_COUNT);
+    double start = now_us();
+
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, img->data, img->sz);
+    jpeg_read_header(&cinfo, TRUE);
+    double t0 = now_us();
+    t[STAGE_HEADER] = t0 - start;
+
+    jpeg_decoder_setup(dec, &cinfo, s->width, s->height);
+    if (!jpeg_decoder_start(dec, &cinfo)) {
+        jpeg_destroy_decompress(&cinfo);
+        return;
+    }
+
+    int off_x = ((int)cinfo.output_width - s->width) / 2;
+    int off_y = ((int)cinfo.output_height - s->height) / 2;
+    if (off_x < 0) off_x = 0;
+    if (off_y < 0) off_y = 0;
+    int visible_w = (int)cinfo.output_width - off_x;
+    if (visible_w > s->width) visible_w = s->width;
+    int visible_h = (int)cinfo.output_height - off_y;
+    if (visible_h > s->height) visible_h = s->height;
+    int x_in_row;
+    jpeg_decoder_set_window(dec, &cinfo, off_x, off_y, visible_w, visible_h, &x_in_row);
+
+    screen_clear(s);
+    int y = off_y;
+    while (true) {
+        int n = jpeg_decoder_read(dec, &cinfo);
+        double t1 = now_us();
+        t[STAGE_DECODE] += t1 - t0;
+        if (n == 0) break;
+
+        for (int i = 0; i < n; i++, y++) {
+            int sy = y - off_y;
+            if (sy < 0 || sy >= s->height) continue;
+            double c0 = now_us();
+            gray_conv_row(conv, dec->rows[i] + x_in_row * cinfo.output_components,
+                          cinfo.output_components, gray, visible_w);
+            double c1 = now_us();
+            screen_write_row(s, 0, sy, gray, visible_w);
+            double c2 = now_us();
+            t[STAGE_CONVERT] += c1 - c0;
+            t[STAGE_WRITE] += c2 - c1;
+        }
+        t0 = now_us();
+    }
+    jpeg_decoder_finish(dec, &cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    double f0 = now_us();
+    screen_flip(s);
+    double end = now_us();
+    t[STAGE_FLIP] = end - f0;
+    t[STAGE_TOTAL] = end - start;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, int n, double p) {
+    int i = (int)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+static const int bench_threads[] = {1, 2, 4};
+#define BENCH_THREADS_N (sizeof(bench_threads) / sizeof(bench_threads[0]))
+
+// A 30 fps transition has 33ms per frame. The effects that blend redraw the whole screen on each.
+static void bench_transitions(struct screen* s, int bpp, struct worker_pool* pool, int iters,
+                              double* samples) {
+    const enum transition_effect effects[] = {TRANSITION_CROSSFADE, TRANSITION_DISSOLVE};
+    for (size_t e = 0; e < sizeof(effects) / sizeof(effects[0]); e++) {
+        struct transition tr;
+        if (!transition_init(&tr, s->width, s->height, effects[e], 0, 30, pool)) return;
+        unsigned seed = 1;
+        for (int y = 0; y < tr.height; y++) {
+            fill_row(tr.shown + (size_t)y * tr.width, tr.width, tr.height, y, 1, &seed);
+            fill_row(tr.next + (size_t)y * tr.width, tr.width, tr.height, y, 1, &seed);
+        }
+
+        for (int it = 0; it < iters; it++) {
+            double t0 = now_us();
+            transition_draw(&tr, s, 1 + it * 254 / iters);
+            screen_flip(s);
+            samples[it] = now_us() - t0;
+        }
+        qsort(samples, iters, sizeof(double), cmp_double);
+        printf("{\"transition\":\"%s\",\"bpp\":%d,\"threads\":%d,\"stage\":\"frame\",\"n\":%d,"
+               "\"min_us\":%.1f,\"median_us\":%.1f,\"p99_us\":%.1f}\n",
+               transition_effect_name(effects[e]), bpp, worker_pool_threads(pool), iters, samples[0],
+               percentile(samples, iters, .5), percentile(samples, iters, .99));
+        transition_free(&tr);
+    }
+}
+
+// Decodes img into a gray8 SCREEN_W x SCREEN_H frame with the serial decoder, like picrt would
+static void decode_serial(const struct corpus_img* img, const struct gray_conv* conv, unsigned char* frame) {
+    struct jpeg_decoder dec;
+    jpeg_decoder_init(&dec, JPEG_DECODE_FAST);
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, img->data, img->sz);
+    jpeg_read_header(&cinfo, TRUE);
+    jpeg_decoder_setup(&dec, &cinfo, SCREEN_W, SCREEN_H);
+    if (jpeg_decoder_start(&dec, &cinfo)) {
+        int off_x = ((int)cinfo.output_width - SCREEN_W) / 2;
+        int off_y = ((int)cinfo.output_height - SCREEN_H) / 2;
+        if (off_x < 0) off_x = 0;
+        if (off_y < 0) off_y = 0;
+        int visible_w = (int)cinfo.output_width - off_x;
+        if (visible_w > SCREEN_W) visible_w = SCREEN_W;
+        int visible_h = (int)cinfo.output_height - off_y;
+        if (visible_h > SCREEN_H) visible_h = SCREEN_H;
+        int x_in_row;
+        jpeg_decoder_set_window(&dec, &cinfo, off_x, off_y, visible_w, visible_h, &x_in_row);
+        int y = 0;
+        int n;
+        while ((n = jpeg_decoder_read(&dec, &cinfo)) > 0) {
+            for (int i = 0; i < n; i++, y++) {
+                gray_conv_row(conv, dec.rows[i] + x_in_row * cinfo.output_components,
+                              cinfo.output_components, frame + (size_t)y * SCREEN_W, visible_w);
+            }
+        }
+        jpeg_decoder_finish(&dec, &cinfo);
+    }
+    jpeg_destroy_decompress(&cinfo);
+    jpeg_decoder_free(&dec);
+}
+
+// Decode and convert into a frame, with a stripe per thread. Stripes must come out exactly like a
+// serial decode: returns false, after saying why, if they don't.
+static bool bench_stripes(struct worker_pool* pool, const struct gray_conv* conv, int iters,
+                          double* samples, unsigned char* frame, unsigned char* expected) {
+    // Odd sizes check partial MCUs at the right and bottom edges
+    const int sizes[][2] = {{1600, 1200}, {3264, 2448}, {1601, 1203}};
+    struct jpeg_stripes* js = jpeg_stripes_new(pool, JPEG_DECODE_FAST, conv);
+    if (!js) return false;
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && ok; i++) {
+        struct corpus_img img;
+        if (!make_jpeg(&img, sizes[i][0], sizes[i][1], true, false, 1)) break;
+
+        memset(expected, 0, SCREEN_W * SCREEN_H);
+        decode_serial(&img, conv, expected);
+        memset(frame, 0, SCREEN_W * SCREEN_H);
+        if (!jpeg_stripes_decode(js, img.data, img.sz, frame, SCREEN_W, SCREEN_H)) {
+            fprintf(stderr, "FAIL: %s wasn't decoded in stripes\n", img.name);
+            ok = false;
+        } else if (memcmp(frame, expected, SCREEN_W * SCREEN_H) != 0) {
+            size_t diff = 0;
+            for (size_t p = 0; p < SCREEN_W * SCREEN_H; p++) diff += frame[p] != expected[p];
+            fprintf(stderr, "FAIL: %s decoded in stripes with %d threads differs from a serial decode in %zu px\n",
+                    img.name, worker_pool_threads(pool), diff);
+            ok = false;
+        }
+
+        for (int it = 0; it < iters && ok; it++) {
+            double t0 = now_us();
+            if (!jpeg_stripes_decode(js, img.data, img.sz, frame, SCREEN_W, SCREEN_H)) {
+                fprintf(stderr, "Failed to decode %s in stripes\n", img.name);
+            }
+            samples[it] = now_us() - t0;
+        }
+        qsort(samples, iters, sizeof(double), cmp_double);
+        printf("{\"image\":\"%s\",\"bytes\":%lu,\"threads\":%d,\"stage\":\"stripes\",\"n\":%d,"
+               "\"min_us\":%.1f,\"median_us\":%.1f,\"p99_us\":%.1f}\n",
+               img.name, img.sz, worker_pool_threads(pool), iters, samples[0],
+               percentile(samples, iters, .5), percentile(samples, iters, .99));
+        free(img.data);
+    }
+    jpeg_stripes_free(js);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    int iters = argc > 1 ? atoi(argv[1]) : 10;
+    if (iters <= 0) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    // Sizes chosen to exercise each DCT scale ratio for a PAL screen, plus a portrait crop
+    const int sizes[][2] = {
+        {720, 576},    // 1/1
+        {1600, 1200},  // 1/2
+        {3264, 2448},  // 1/4
+        {5800, 4640},  // 1/8
+        {1536, 2048},  // 1/2, portrait: mostly cropped
+        {2448, 3264},  // 1/2, portrait phone photo
+    };
+    const size_t n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    const size_t n_imgs = n_sizes * 4;
+    struct corpus_img* corpus = calloc(n_imgs, sizeof(struct corpus_img));
+    if (!corpus) return 1;
+
+    fprintf(stderr, "Generating %zu test images...\n", n_imgs);
+    size_t n = 0;
+    for (size_t i = 0; i < n_sizes; i++) {
+        for (int progressive = 0; progressive < 2; progressive++) {
+            for (int color = 0; color < 2; color++) {
+                if (!make_jpeg(&corpus[n++], sizes[i][0], sizes[i][1], color, progressive, 0)) {
+                    fprintf(stderr, "bad alloc\n");
+                    return 1;
+                }
+            }
+        }
+    }
+
+    struct gray_conv conv;
+    gray_conv_init(&conv, GAMMA);
+    unsigned char* gray = malloc(SCREEN_W);
+    double* samples = malloc(sizeof(double) * iters * STAGE_COUNT);
+    double* sorted = malloc(sizeof(double) * iters);
+    if (!gray || !samples || !sorted) return 1;
+
+    const int bpps[] = {32, 16};
+    const enum jpeg_decode_profile profiles[] = {JPEG_DECODE_FAST, JPEG_DECODE_QUALITY};
+    for (size_t b = 0; b < sizeof(bpps) / sizeof(bpps[0]); b++) {
+        struct screen* s = screen_mem_new(SCREEN_W, SCREEN_H, bpps[b]);
+        if (!s) return 1;
+
+        for (size_t p = 0; p < sizeof(profiles) / sizeof(profiles[0]); p++) {
+            struct jpeg_decoder dec;
+            jpeg_decoder_init(&dec, profiles[p]);
+
+            for (size_t i = 0; i < n_imgs; i++) {
+                fprintf(stderr, "%s %dbpp %s\n", jpeg_decode_profile_name(profiles[p]), bpps[b], corpus[i].name);
+                double t[STAGE_COUNT];
+                // Warm up caches and the decoder's row buffer
+                render_once(s, &dec, &conv, gray, &corpus[i], t);
+                for (int it = 0; it < iters; it++) {
+                    render_once(s, &dec, &conv, gray, &corpus[i], t);
+                    for (int st = 0; st < STAGE_COUNT; st++) {
+                        samples[st * iters + it] = t[st];
+                    }
+                }
+
+                for (int st = 0; st < STAGE_COUNT; st++) {
+                    memcpy(sorted, &samples[st * iters], sizeof(double) * iters);
+                    qsort(sorted, iters, sizeof(double), cmp_double);
+                    printf("{\"image\":\"%s\",\"bytes\":%lu,\"profile\":\"%s\",\"bpp\":%d,"
+                           "\"stage\":\"%s\",\"n\":%d,\"min_us\":%.1f,\"median_us\":%.1f,\"p99_us\":%.1f}\n",
+                           corpus[i].name, corpus[i].sz, jpeg_decode_profile_name(profiles[p]), bpps[b],
+                           stage_names[st], iters, sorted[0], percentile(sorted, iters, .5),
+                           percentile(sorted, iters, .99));
+                }
+            }
+            jpeg_decoder_free(&dec);
+        }
+        for (size_t t = 0; t < BENCH_THREADS_N; t++) {
+            fprintf(stderr, "transitions %dbpp, %d threads\n", bpps[b], bench_threads[t]);
+            struct worker_pool* pool = worker_pool_new(bench_threads[t]);
+            bench_transitions(s, bpps[b], pool, iters, sorted);
+            worker_pool_free(pool);
+        }
+        screen_free(s);
+    }
+
+    unsigned char* frame = malloc(SCREEN_W * SCREEN_H);
+    unsigned char* expected = malloc(SCREEN_W * SCREEN_H);
+    if (!frame || !expected) return 1;
+    bool stripes_ok = true;
+    for (size_t t = 0; t < BENCH_THREADS_N && stripes_ok; t++) {
+        fprintf(stderr, "stripes, %d threads\n", bench_threads[t]);
+        struct worker_pool* pool = worker_pool_new(bench_threads[t]);
+        stripes_ok = bench_stripes(pool, &conv, iters, sorted, frame, expected);
+        worker_pool_free(pool);
+    }
+    free(expected);
+    free(frame);
+
+    for (size_t i = 0; i < n_imgs; i++) {
+        free(corpus[i].data);
+    }
+    free(corpus);
+    free(gray);
+    free(samples);
+    free(sorted);
+    return stripes_ok ? 0 : 1;
+}
@@ -0,0 +1,171 @@
+#include "gray_conv.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GRAY_CONV_NEON 1
+#endif
+
+// BT.601 luma weights scaled to 256: 0.299, 0.587, 0.114
+#define LUMA_R 77
+#define LUMA_G 150
+#define LUMA_B 29
+
+void gray_conv_init(struct gray_conv* c, double gamma) {
+    c->gamma = gamma;
+    for (int i = 0; i < 256; i++) {
+        c->gamma_lut[i] = (unsigned char)(255.0 * pow(i / 255.0, gamma));
+    }
+}
+
+static inline unsigned char luma(unsigned char r, unsigned char g, unsigned char b) {
+    return (unsigned char)((LUMA_R * r + LUMA_G * g + LUMA_B * b + 128) >> 8);
+}
+
+#ifdef GRAY_CONV_NEON
+// 256 entry table lookup: tbl returns 0 for out of range indices, so looking up
+// each 64 byte quarter with a shifted index and OR'ing the results is exact
+static inline uint8x16_t lut_lookup(const uint8x16x4_t lut[4], uint8x16_t idx) {
+    const uint8x16_t k64 = vdupq_n_u8(64);
+    uint8x16_t r = vqtbl4q_u8(lut[0], idx);
+    idx = vsubq_u8(idx, k64);
+    r = vorrq_u8(r, vqtbl4q_u8(lut[1], idx));
+    idx = vsubq_u8(idx, k64);
+    r = vorrq_u8(r, vqtbl4q_u8(lut[2], idx));
+    idx = vsubq_u8(idx, k64);
+    r = vorrq_u8(r, vqtbl4q_u8(lut[3], idx));
+    return r;
+}
+
+static inline void lut_load(const struct gray_conv* c, uint8x16x4_t lut[4]) {
+    for (int i = 0; i < 4; i++) {
+        lut[i] = vld1q_u8_x4(c->gamma_lut + 64 * i);
+    }
+}
+#endif
+
+void gray_conv_row_rgb(const struct gray_conv* c, const unsigned char* src,
+                       unsigned char* dst, size_t n) {
+    size_t i = 0;
+#ifdef GRAY_CONV_NEON
+    uint8x16x4_t lut[4];
+    lut_load(c, lut);
+    const uint8x8_t wr = vdup_n_u8(LUMA_R);
+    const uint8x8_t wg = vdup_n_u8(LUMA_G);
+    const uint8x8_t wb = vdup_n_u8(LUMA_B);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x3_t px = vld3q_u8(src + 3 * i);
+        uint16x8_t lo = vmull_u8(vget_low_u8(px.val[0]), wr);
+        lo = vmlal_u8(lo, vget_low_u8(px.val[1]), wg);
+        lo = vmlal_u8(lo, vget_low_u8(px.val[2]), wb);
+        uint16x8_t hi = vmull_u8(vget_high_u8(px.val[0]), wr);
+        hi = vmlal_u8(hi, vget_high_u8(px.val[1]), wg);
+        hi = vmlal_u8(hi, vget_high_u8(px.val[2]), wb);
+        uint8x16_t y = vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8));
+        vst1q_u8(dst + i, lut_lookup(lut, y));
+    }
+#endif
+    for (; i < n; i++) {
+        const unsigned char* p = src + 3 * i;
+        dst[i] = c->gamma_lut[luma(p[0], p[1], p[2])];
+    }
+}
+
+void gray_conv_row_gray(const struct gray_conv* c, const unsigned char* src,
+                        unsigned char* dst, size_t n) {
+    size_t i = 0;
+#ifdef GRAY_CONV_NEON
+    uint8x16x4_t lut[4];
+    lut_load(c, lut);
+    for (; i + 16 <= n; i += 16) {
+        vst1q_u8(dst + i, lut_lookup(lut, vld1q_u8(src + i)));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = c->gamma_lut[src[i]];
+    }
+}
+
+void gray_conv_row_rgb565(const struct gray_conv* c, const unsigned char* src,
+                          unsigned char* dst, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        const unsigned px = src[2 * i] | (src[2 * i + 1] << 8);
+        // Replicate the top bits, so 0x1F expands to 0xFF
+        const unsigned r = (px >> 11) & 0x1F, g = (px >> 5) & 0x3F, b = px & 0x1F;
+        dst[i] = c->gamma_lut[luma((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2))];
+    }
+}
+
+void gray_conv_row(const struct gray_conv* c, const unsigned char* src,
+                   int components, unsigned char* dst, size_t n) {
+    if (components >= 3) {
+        gray_conv_row_rgb(c, src, dst, n);
+    } else {
+        gray_conv_row_gray(c, src, dst, n);
+    }
+}
+
+// Per-pixel conversion as picrt used to do it, kept as a baseline for the bench
+static void legacy_row_rgb(const unsigned char* src, unsigned char* dst, size_t n, double gamma) {
+    for (size_t i = 0; i < n; i++) {
+        const unsigned char* p = src + 3 * i;
+        dst[i] = (unsigned char)(255.0 * pow((0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2]) / 255.0, gamma));
+    }
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void gray_conv_bench(double gamma, size_t row_len) {
+    const int reps = 2000;
+    unsigned char* src = malloc(row_len * 3);
+    unsigned char* dst = malloc(row_len);
+    if (!src || !dst) {
+        fprintf(stderr, "bad alloc\n");
+        free(src);
+        free(dst);
+        return;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < row_len * 3; i++) {
+        src[i] = rand() & 0xFF;
+    }
+
+    struct gray_conv c;
+    double t0 = now_ns();
+    gray_conv_init(&c, gamma);
+    double init_ns = now_ns() - t0;
+
+    t0 = now_ns();
+    for (int r = 0; r < reps; r++) legacy_row_rgb(src, dst, row_len, gamma);
+    double legacy_ns = (now_ns() - t0) / reps;
+
+    t0 = now_ns();
+    for (int r = 0; r < reps; r++) gray_conv_row_rgb(&c, src, dst, row_len);
+    double rgb_ns = (now_ns() - t0) / reps;
+
+    t0 = now_ns();
+    for (int r = 0; r < reps; r++) gray_conv_row_gray(&c, src, dst, row_len);
+    double gray_ns = (now_ns() - t0) / reps;
+
+#ifdef GRAY_CONV_NEON
+    const char* impl = "neon";
+#else
+    const char* impl = "scalar";
+#endif
+    printf("gray_conv (%s), %zu px/row, gamma %.2f, LUT init %.0f ns\n", impl, row_len, gamma, init_ns);
+    printf("  legacy pow() rgb: %9.0f ns/row\n", legacy_ns);
+    printf("  lut rgb:          %9.0f ns/row (%.1fx)\n", rgb_ns, legacy_ns / rgb_ns);
+    printf("  lut gray:         %9.0f ns/row\n", gray_ns);
+
+    free(src);
+    free(dst);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Converts decoded image rows to gamma-corrected 8 bit gray.
+ *
+ * Luma is computed in 8.8 fixed point (BT.601 weights) and gamma is applied
+ * through a LUT built once by gray_conv_init, so the per-pixel cost is a few
+ * integer multiplies and a table lookup. On aarch64 whole rows are processed
+ * 16 pixels at a time with NEON; elsewhere a scalar loop is used.
+ */
+struct gray_conv {
+    double gamma;
+    unsigned char gamma_lut[256];
+};
+
+void gray_conv_init(struct gray_conv* c, double gamma);
+
+// Converts n pixels of packed RGB (3 bytes per pixel) to gray
+void gray_conv_row_rgb(const struct gray_conv* c, const unsigned char* src,
+                       unsigned char* dst, size_t n);
+
+// Applies gamma to n pixels of 8 bit gray. src and dst may alias.
+void gray_conv_row_gray(const struct gray_conv* c, const unsigned char* src,
+                        unsigned char* dst, size_t n);
+
+// Converts n pixels of RGB565 (little endian, 2 bytes per pixel) to gray
+void gray_conv_row_rgb565(const struct gray_conv* c, const unsigned char* src,
+                          unsigned char* dst, size_t n);
+
+// Dispatches on the number of components of a libjpeg output row (1 or 3)
+void gray_conv_row(const struct gray_conv* c, const unsigned char* src,
+                   int components, unsigned char* dst, size_t n);
+
+// Prints per-row timings of the converter against the old per-pixel pow() path
+void gray_conv_bench(double gamma, size_t row_len);
@@ -0,0 +1,495 @@
+// For syncfs
+#define _GNU_SOURCE
+
+#include "disk_cache.h"
+#include "../mem_budget.h"
+#include "../trace.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Pending images are written once there are this many, or the oldest one has
+// waited this long (checked on each put)
+#define WRITE_BATCH_N 4
+#define WRITE_BATCH_MAX_SEC 60
+
+struct cache_entry {
+    uint64_t hash;
+    size_t sz;
+};
+
+struct pending_img {
+    uint64_t hash;
+    unsigned char* data;
+    size_t sz;
+};
+
+/**
+ * The index is an array ordered from least to most recently stored image, so
+ * eviction takes from the front. It's shared between the writer thread and
+ * whoever maps images, and protected by mut. The pending list is only used by
+ * the writer thread.
+ */
+struct disk_cache {
+    char* dir;
+    int dir_fd;
+    size_t max_bytes;
+
+    pthread_mutex_t mut;
+    struct cache_entry* entries;
+    size_t entries_n;
+    size_t entries_cap;
+    size_t total_bytes;
+    size_t next_read;
+
+    struct pending_img pending[WRITE_BATCH_N];
+    size_t pending_n;
+    time_t oldest_pending;
+};
+
+// FNV-1a: not cryptographic, but enough to tell images apart
+static uint64_t hash_img(const unsigned char* data, size_t sz)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < sz; ++i) {
+        h ^= data[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static void entry_name(uint64_t hash, char* out, size_t out_sz)
+{
+    snprintf(out, out_sz, "%016" PRIx64 ".jpg", hash);
+}
+
+// Returns false if name isn't a cache file
+static bool parse_entry_name(const char* name, uint64_t* hash)
+{
+    char* end;
+    if (strlen(name) != 16 + strlen(".jpg")) {
+        return false;
+    }
+    errno = 0;
+    unsigned long long h = strtoull(name, &end, 16);
+    if (errno != 0 || end != name + 16 || strcmp(end, ".jpg") != 0) {
+        return false;
+    }
+    *hash = h;
+    return true;
+}
+
+static ssize_t find_entry(struct disk_cache* c, uint64_t hash)
+{
+    for (size_t i = 0; i < c->entries_n; ++i) {
+        if (c->entries[i].hash == hash) {
+            return (ssize_t)i;
+        }
+    }
+    return -1;
+}
+
+static bool append_entry(struct disk_cache* c, uint64_t hash, size_t sz)
+{
+    if (c->entries_n == c->entries_cap) {
+        size_t cap = c->entries_cap ? c->entries_cap * 2 : 64;
+        struct cache_entry* e = realloc(c->entries, cap * sizeof(struct cache_entry));
+        if (!e) {
+            fprintf(stderr, "disk cache: bad alloc\n");
+            return false;
+        }
+        c->entries = e;
+        c->entries_cap = cap;
+    }
+    c->entries[c->entries_n].hash = hash;
+    c->entries[c->entries_n].sz = sz;
+    c->entries_n++;
+    c->total_bytes += sz;
+    return true;
+}
+
+static void remove_entry(struct disk_cache* c, size_t i)
+{
+    c->total_bytes -= c->entries[i].sz;
+    memmove(&c->entries[i], &c->entries[i + 1], (c->entries_n - i - 1) * sizeof(struct cache_entry));
+    c->entries_n--;
+    if (c->next_read > i) {
+        c->next_read--;
+    }
+}
+
+struct scanned_entry {
+    struct cache_entry e;
+    time_t mtime;
+};
+
+static int cmp_mtime(const void* a, const void* b)
+{
+    time_t x = ((const struct scanned_entry*)a)->mtime;
+    time_t y = ((const struct scanned_entry*)b)->mtime;
+    return (x > y) - (x < y);
+}
+
+// Indexes the files already in the cache dir, oldest first
+static bool scan_dir(struct disk_cache* c)
+{
+    int fd = dup(c->dir_fd);
+    DIR* d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        perror(c->dir);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    struct scanned_entry* found = NULL;
+    size_t found_n = 0, found_cap = 0;
+    struct dirent* de;
+    while ((de = readdir(d))) {
+        uint64_t hash;
+        if (!parse_entry_name(de->d_name, &hash)) {
+            size_t len = strlen(de->d_name);
+            if (len > 4 && strcmp(de->d_name + len - 4, ".tmp") == 0) {
+                // Leftover of a write interrupted by a crash or power loss
+                unlinkat(c->dir_fd, de->d_name, 0);
+            }
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(c->dir_fd, de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        if (found_n == found_cap) {
+            found_cap = found_cap ? found_cap * 2 : 64;
+            struct scanned_entry* f = realloc(found, found_cap * sizeof(struct scanned_entry));
+            if (!f) {
+                fprintf(stderr, "disk cache: bad alloc\n");
+                free(found);
+                closedir(d);
+                return false;
+            }
+            found = f;
+        }
+        found[found_n].e.hash = hash;
+        found[found_n].e.sz = st.st_size;
+        found[found_n].mtime = st.st_mtime;
+        found_n++;
+    }
+    closedir(d);
+
+    qsort(found, found_n, sizeof(struct scanned_entry), cmp_mtime);
+    for (size_t i = 0; i < found_n; ++i) {
+        if (!append_entry(c, found[i].e.hash, found[i].e.sz)) {
+            free(found);
+            return false;
+        }
+    }
+    free(found);
+    return true;
+}
+
+// Deletes the oldest images until the cache fits its budget. Call with mut held.
+static void evict(struct disk_cache* c)
+{
+    while (c->total_bytes > c->max_bytes && c->entries_n > 0) {
+        char name[32];
+        entry_name(c->entries[0].hash, name, sizeof(name));
+        if (unlinkat(c->dir_fd, name, 0) != 0 && errno != ENOENT) {
+            perror("disk cache: unlink");
+        }
+        remove_entry(c, 0);
+    }
+}
+
+// mkdir -p: creates dir and any missing parents
+static bool make_dirs(const char* dir)
+{
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    for (char* p = path + 1; *p; ++p) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        *p = '/';
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+struct disk_cache* disk_cache_init(const char* dir, size_t max_bytes)
+{
+    if (!dir) {
+        return NULL;
+    }
+
+    struct disk_cache* c = calloc(1, sizeof(struct disk_cache));
+    if (!c) {
+        fprintf(stderr, "bad alloc\n");
+        return NULL;
+    }
+    c->dir_fd = -1;
+    c->max_bytes = max_bytes;
+    pthread_mutex_init(&c->mut, NULL);
+
+    c->dir = strdup(dir);
+    if (!c->dir) {
+        fprintf(stderr, "bad alloc\n");
+        disk_cache_free(c);
+        return NULL;
+    }
+
+    if (!make_dirs(dir)) {
+        fprintf(stderr, "Can't create image cache dir %s: %s\n", dir, strerror(errno));
+        disk_cache_free(c);
+        return NULL;
+    }
+
+    c->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (c->dir_fd < 0) {
+        fprintf(stderr, "Can't open image cache dir %s: %s\n", dir, strerror(errno));
+        disk_cache_free(c);
+        return NULL;
+    }
+
+    if (!scan_dir(c)) {
+        disk_cache_free(c);
+        return NULL;
+    }
+    evict(c);
+
+    printf("Image cache %s: %zu images, %zu KB of %zu KB\n", dir, c->entries_n,
+           c->total_bytes / 1024, c->max_bytes / 1024);
+    return c;
+}
+
+void disk_cache_free(struct disk_cache* c)
+{
+    if (!c) {
+        return;
+    }
+
+    if (c->dir_fd >= 0) {
+        disk_cache_flush(c);
+        close(c->dir_fd);
+    }
+    for (size_t i = 0; i < c->pending_n; ++i) {
+        free(c->pending[i].data);
+        mem_budget_release(MEM_DISK_CACHE, c->pending[i].sz);
+    }
+    free(c->entries);
+    free(c->dir);
+    pthread_mutex_destroy(&c->mut);
+    free(c);
+}
+
+// Writes an image to a temp file, and renames it once complete, so a crash
+// never leaves a truncated image in the cache
+static bool write_img(struct disk_cache* c, const struct pending_img* img)
+{
+    char name[32], tmp_name[40];
+    entry_name(img->hash, name, sizeof(name));
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+
+    int fd = openat(c->dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("disk cache: open");
+        return false;
+    }
+
+    size_t done = 0;
+    while (done < img->sz) {
+        ssize_t n = write(fd, img->data + done, img->sz - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("disk cache: write");
+            close(fd);
+            unlinkat(c->dir_fd, tmp_name, 0);
+            return false;
+        }
+        done += n;
+    }
+    close(fd);
+
+    if (renameat(c->dir_fd, tmp_name, c->dir_fd, name) != 0) {
+        perror("disk cache: rename");
+        unlinkat(c->dir_fd, tmp_name, 0);
+        return false;
+    }
+    return true;
+}
+
+void disk_cache_flush(struct disk_cache* c)
+{
+    if (c->pending_n == 0) {
+        return;
+    }
+
+    uint64_t trace_t = trace_begin();
+    size_t written = 0;
+    for (size_t i = 0; i < c->pending_n; ++i) {
+        struct pending_img* img = &c->pending[i];
+        if (write_img(c, img)) {
+            pthread_mutex_lock(&c->mut);
+            if (append_entry(c, img->hash, img->sz)) {
+                written++;
+            }
+            pthread_mutex_unlock(&c->mut);
+        }
+        free(img->data);
+        mem_budget_release(MEM_DISK_CACHE, img->sz);
+        img->data = NULL;
+    }
+    c->pending_n = 0;
+    trace_end("disk cache write", trace_t);
+
+    // One sync for the whole batch, instead of one per file
+    trace_t = trace_begin();
+    if (written > 0 && syncfs(c->dir_fd) != 0) {
+        perror("disk cache: sync");
+    }
+    trace_end("disk cache sync", trace_t);
+
+    pthread_mutex_lock(&c->mut);
+    evict(c);
+    printf("Image cache: stored %zu images, %zu images cached, %zu KB\n",
+           written, c->entries_n, c->total_bytes / 1024);
+    pthread_mutex_unlock(&c->mut);
+}
+
+void disk_cache_put(struct disk_cache* c, const unsigned char* data, size_t sz)
+{
+    if (!c || !data || sz == 0 || sz > c->max_bytes) {
+        return;
+    }
+
+    const uint64_t hash = hash_img(data, sz);
+    for (size_t i = 0; i < c->pending_n; ++i) {
+        if (c->pending[i].hash == hash) {
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&c->mut);
+    ssize_t i = find_entry(c, hash);
+    if (i >= 0) {
+        // Already stored: only mark it as recently used. The file's mtime is
+        // left alone, so a restart may evict it a bit early.
+        struct cache_entry e = c->entries[i];
+        remove_entry(c, i);
+        append_entry(c, e.hash, e.sz);
+        pthread_mutex_unlock(&c->mut);
+        return;
+    }
+    pthread_mutex_unlock(&c->mut);
+
+    if (!mem_budget_reserve(MEM_DISK_CACHE, sz)) {
+        fprintf(stderr, "disk cache: image doesn't fit in memory budget, won't store it\n");
+        return;
+    }
+    unsigned char* copy = malloc(sz);
+    if (!copy) {
+        fprintf(stderr, "disk cache: bad alloc\n");
+        mem_budget_release(MEM_DISK_CACHE, sz);
+        return;
+    }
+    memcpy(copy, data, sz);
+
+    if (c->pending_n == 0) {
+        c->oldest_pending = time(NULL);
+    }
+    c->pending[c->pending_n].hash = hash;
+    c->pending[c->pending_n].data = copy;
+    c->pending[c->pending_n].sz = sz;
+    c->pending_n++;
+
+    if (c->pending_n == WRITE_BATCH_N || time(NULL) - c->oldest_pending >= WRITE_BATCH_MAX_SEC) {
+        disk_cache_flush(c);
+    }
+}
+
+size_t disk_cache_count(struct disk_cache* c)
+{
+    pthread_mutex_lock(&c->mut);
+    size_t n = c->entries_n;
+    pthread_mutex_unlock(&c->mut);
+    return n;
+}
+
+static bool map_file(struct disk_cache* c, uint64_t hash, struct disk_cache_img* img)
+{
+    char name[32];
+    entry_name(hash, name, sizeof(name));
+    int fd = openat(c->dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("disk cache: mmap");
+        return false;
+    }
+
+    img->data = data;
+    img->sz = st.st_size;
+    return true;
+}
+
+bool disk_cache_map_next(struct disk_cache* c, struct disk_cache_img* img)
+{
+    img->data = NULL;
+    img->sz = 0;
+
+    // An entry may be evicted after we pick it; then try the next one
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        pthread_mutex_lock(&c->mut);
+        if (c->entries_n == 0) {
+            pthread_mutex_unlock(&c->mut);
+            return false;
+        }
+        if (c->next_read >= c->entries_n) {
+            c->next_read = 0;
+        }
+        uint64_t hash = c->entries[c->next_read++].hash;
+        pthread_mutex_unlock(&c->mut);
+
+        if (map_file(c, hash, img)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void disk_cache_unmap(struct disk_cache_img* img)
+{
+    if (img->data) {
+        munmap((void*)img->data, img->sz);
+    }
+    img->data = NULL;
+    img->sz = 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct disk_cache;
+
+/**
+ * An image mapped from the disk cache. Valid until disk_cache_unmap.
+ */
+struct disk_cache_img {
+    const unsigned char* data;
+    size_t sz;
+};
+
+/**
+ * Bounded on-disk cache of downloaded images, so there is something to show
+ * when the image server can't be reached (or hasn't been yet, eg right after
+ * a restart). Files are named after a hash of their contents, so an image
+ * downloaded twice is only stored once. When the cache grows over max_bytes,
+ * the least recently stored images are deleted.
+ *
+ * Creates dir (and its parents) if needed, and indexes the images already in it. Returns NULL
+ * if the cache can't be used.
+ */
+struct disk_cache* disk_cache_init(const char* dir, size_t max_bytes);
+
+// Writes any pending images before freeing the cache
+void disk_cache_free(struct disk_cache* c);
+
+/**
+ * Queues a copy of an image to be stored. Writes are batched to spare the SD
+ * card: pending images are written (and synced once for the whole batch) from
+ * the calling thread, every few images or after a while. Call from a single
+ * thread, not the render thread.
+ */
+void disk_cache_put(struct disk_cache* c, const unsigned char* data, size_t sz);
+
+// Writes all pending images now
+void disk_cache_flush(struct disk_cache* c);
+
+// Number of images stored on disk
+size_t disk_cache_count(struct disk_cache* c);
+
+/**
+ * Maps the next cached image, cycling from oldest to newest. Returns false if
+ * the cache is empty. Can be called from any thread.
+ */
+bool disk_cache_map_next(struct disk_cache* c, struct disk_cache_img* img);
+void disk_cache_unmap(struct disk_cache_img* img);
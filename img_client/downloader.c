@@ -1,35 +1,113 @@
 #include "downloader.h"
+#include "../mem_budget.h"
 
 #include <curl/curl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+struct dl_transfer {
+    struct downloader_ctx* ctx;
+    CURL* curl_handle;
+    struct dl_buf buf;
+    bool busy;
+    size_t allocs;
+    size_t bytes_copied;
+};
+
+/**
+ * One easy handle per transfer slot, all driven by the same multi handle. The
+ * multi handle owns the connection cache and DNS cache, so they are shared by
+ * every transfer.
+ */
 struct downloader_ctx {
     char* www_url;
-    CURL* curl_handle;
-    unsigned char* mem_buf;
-    size_t mem_buf_sz;
+    CURLM* multi_handle;
+    struct dl_transfer* xfers;
+    size_t max_parallel;
+    size_t in_flight;
+    const atomic_bool* cancel;
+    struct downloader_stats stats;
 };
 
+// Smallest buffer to allocate when the server doesn't send a Content-Length
+#define MIN_BUF_SZ (64 * 1024)
+
+// Connecting gets at most this long, even if the transfer deadline is longer
+#define CONNECT_TIMEOUT_MS 5000
+// A transfer is stalled if it gets less than this for a while, see downloader_set_timeouts
+#define LOW_SPEED_BYTES_PER_SEC 512
+
 static size_t write_data(void* ptr, size_t size, size_t nmemb, void* usr);
+static int xferinfo(void* usr, curl_off_t dltotal, curl_off_t dlnow,
+                    curl_off_t ultotal, curl_off_t ulnow);
 
-struct downloader_ctx* downloader_init(const char* www_url)
+int downloader_set_timeouts(void* curl_handle, long timeout_ms)
+{
+    const long connect_ms = timeout_ms < CONNECT_TIMEOUT_MS ? timeout_ms : CONNECT_TIMEOUT_MS;
+    const long stall_sec = timeout_ms / 4000 > 0 ? timeout_ms / 4000 : 1;
+    int ret = CURLE_OK;
+    ret = ret | curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT_MS, timeout_ms);
+    ret = ret | curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT_MS, connect_ms);
+    ret = ret | curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_LIMIT, (long)LOW_SPEED_BYTES_PER_SEC);
+    ret = ret | curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_TIME, stall_sec);
+    return ret;
+}
+
+static bool transfer_init(struct downloader_ctx* ctx, struct dl_transfer* xfer, long timeout_ms)
+{
+    xfer->ctx = ctx;
+    xfer->curl_handle = curl_easy_init();
+    if (!xfer->curl_handle) {
+        fprintf(stderr, "Failed to create curl_handle\n");
+        return false;
+    }
+
+    int ret = CURLE_OK;
+    ret = ret | curl_easy_setopt(xfer->curl_handle, CURLOPT_VERBOSE, 0L);
+    ret = ret | curl_easy_setopt(xfer->curl_handle, CURLOPT_NOPROGRESS, 0L);
+    ret = ret | curl_easy_setopt(xfer->curl_handle, CURLOPT_XFERINFOFUNCTION, xferinfo);
+    ret = ret | curl_easy_setopt(xfer->curl_handle, CURLOPT_XFERINFODATA, xfer);
+    ret = ret | curl_easy_setopt(xfer->curl_handle, CURLOPT_WRITEFUNCTION, write_data);
+    ret = ret | curl_easy_setopt(xfer->curl_handle, CURLOPT_WRITEDATA, xfer);
+    ret = ret | curl_easy_setopt(xfer->curl_handle, CURLOPT_URL, ctx->www_url);
+    ret = ret | curl_easy_setopt(xfer->curl_handle, CURLOPT_PRIVATE, xfer);
+    // Keep idle connections alive between refills, so they can be reused
+    ret = ret | curl_easy_setopt(xfer->curl_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    ret = ret | downloader_set_timeouts(xfer->curl_handle, timeout_ms);
+    if (ret != CURLE_OK) {
+        fprintf(stderr, "Failed to setup curl: %s\n", curl_easy_strerror(ret));
+        return false;
+    }
+
+    return true;
+}
+
+struct downloader_ctx* downloader_init(const char* www_url, size_t max_parallel, long timeout_ms)
 {
     if (!www_url) {
         fprintf(stderr, "Missing www_url\n");
         return NULL;
     }
 
+    if (max_parallel == 0) {
+        fprintf(stderr, "Can't use downloader with max parallel transfers = 0\n");
+        return NULL;
+    }
+
     struct downloader_ctx* ctx = malloc(sizeof(struct downloader_ctx));
     if (!ctx) {
         fprintf(stderr, "bad alloc\n");
         return NULL;
     }
 
-    ctx->mem_buf = NULL;
-    ctx->mem_buf_sz = 0;
-    ctx->curl_handle = NULL;
+    ctx->multi_handle = NULL;
+    ctx->xfers = NULL;
+    ctx->max_parallel = max_parallel;
+    ctx->in_flight = 0;
+    ctx->cancel = NULL;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
 
     ctx->www_url = strdup(www_url);
     if (!ctx->www_url) {
@@ -38,35 +116,30 @@ struct downloader_ctx* downloader_init(const char* www_url)
         return NULL;
     }
 
-    {
-        const int ret = curl_global_init(CURL_GLOBAL_ALL);
-        if (ret != 0) {
-            fprintf(stderr, "Failed to global init curl: %s\n",
-                    curl_easy_strerror(ret));
-            downloader_free(ctx);
-            return NULL;
-        }
-    }
-
-    ctx->curl_handle = curl_easy_init();
-    if (!ctx->curl_handle) {
-        fprintf(stderr, "Failed to create curl_handle\n");
+    ctx->multi_handle = curl_multi_init();
+    if (!ctx->multi_handle) {
+        fprintf(stderr, "Failed to create curl multi handle\n");
         downloader_free(ctx);
         return NULL;
     }
 
-    int ret = CURLE_OK;
-    ret = ret | curl_easy_setopt(ctx->curl_handle, CURLOPT_VERBOSE, 0L);
-    ret = ret | curl_easy_setopt(ctx->curl_handle, CURLOPT_NOPROGRESS, 1L);
-    ret = ret | curl_easy_setopt(ctx->curl_handle, CURLOPT_WRITEFUNCTION, write_data);
-    ret = ret | curl_easy_setopt(ctx->curl_handle, CURLOPT_WRITEDATA, ctx);
-    ret = ret | curl_easy_setopt(ctx->curl_handle, CURLOPT_URL, ctx->www_url);
-    if (ret != CURLE_OK) {
-        fprintf(stderr, "Failed to setup curl: %s\n", curl_easy_strerror(ret));
+    // Don't open more connections than transfers; with HTTP/1.1 one connection per transfer
+    curl_multi_setopt(ctx->multi_handle, CURLMOPT_MAX_HOST_CONNECTIONS, (long)max_parallel);
+
+    ctx->xfers = calloc(max_parallel, sizeof(struct dl_transfer));
+    if (!ctx->xfers) {
+        fprintf(stderr, "bad alloc\n");
         downloader_free(ctx);
         return NULL;
     }
 
+    for (size_t i = 0; i < max_parallel; ++i) {
+        if (!transfer_init(ctx, &ctx->xfers[i], timeout_ms)) {
+            downloader_free(ctx);
+            return NULL;
+        }
+    }
+
     return ctx;
 }
 
@@ -76,57 +149,231 @@ void downloader_free(struct downloader_ctx* ctx)
         return;
     }
 
-    if (ctx->curl_handle) {
-        curl_easy_cleanup(ctx->curl_handle);
+    if (ctx->xfers) {
+        for (size_t i = 0; i < ctx->max_parallel; ++i) {
+            struct dl_transfer* xfer = &ctx->xfers[i];
+            if (!xfer->curl_handle) {
+                continue;
+            }
+            if (xfer->busy) {
+                // Never handed back, so we still own the buffer
+                curl_multi_remove_handle(ctx->multi_handle, xfer->curl_handle);
+                free(xfer->buf.data);
+                mem_budget_release(MEM_DOWNLOAD, xfer->buf.cap);
+            }
+            curl_easy_cleanup(xfer->curl_handle);
+        }
+        free(ctx->xfers);
     }
 
-    curl_global_cleanup();
+    if (ctx->multi_handle) {
+        curl_multi_cleanup(ctx->multi_handle);
+    }
 
-    free(ctx->mem_buf);
     free(ctx->www_url);
     free(ctx);
 }
 
-static size_t write_data(void* ptr, size_t size, size_t nmemb, void* usr)
+size_t downloader_in_flight(struct downloader_ctx* ctx)
 {
-    size_t chunk_sz = size * nmemb;
-    struct downloader_ctx* ctx = usr;
+    return ctx->in_flight;
+}
+
+// Grows the buffer to at least need bytes. Returns false on bad alloc, or if
+// it doesn't fit in the memory budget; the transfer is then aborted.
+static bool buf_reserve(struct dl_transfer* xfer, size_t need)
+{
+    struct dl_buf* buf = &xfer->buf;
+    if (need <= buf->cap) {
+        return true;
+    }
+
+    if (!mem_budget_reserve(MEM_DOWNLOAD, need - buf->cap)) {
+        fprintf(stderr, "Fail to download, %zu KB image doesn't fit in memory budget\n", need / 1024);
+        return false;
+    }
 
-    unsigned char* reallocd = realloc(ctx->mem_buf, ctx->mem_buf_sz + chunk_sz);
+    uintptr_t old = (uintptr_t)buf->data;
+    unsigned char* reallocd = realloc(buf->data, need);
     if (!reallocd) {
         fprintf(stderr, "Fail to download, bad alloc\n");
-        return 0;
+        mem_budget_release(MEM_DOWNLOAD, need - buf->cap);
+        return false;
+    }
+
+    xfer->allocs++;
+    if (old && (uintptr_t)reallocd != old) {
+        // realloc had to move what we had so far
+        xfer->bytes_copied += buf->sz;
     }
+    buf->data = reallocd;
+    buf->cap = need;
+    return true;
+}
 
-    ctx->mem_buf = reallocd;
-    memcpy(ctx->mem_buf + ctx->mem_buf_sz, ptr, chunk_sz);
-    ctx->mem_buf_sz += chunk_sz;
+static size_t write_data(void* ptr, size_t size, size_t nmemb, void* usr)
+{
+    size_t chunk_sz = size * nmemb;
+    struct dl_transfer* xfer = usr;
+    struct dl_buf* buf = &xfer->buf;
+
+    if (buf->sz == 0) {
+        // Don't keep error pages, nor grow the buffer for them
+        long http_code = 0;
+        curl_easy_getinfo(xfer->curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
+        if (http_code != 200) {
+            return 0;
+        }
+
+        // First chunk: if the server told us the size, allocate it all at once
+        curl_off_t content_len = -1;
+        curl_easy_getinfo(xfer->curl_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_len);
+        if (content_len > 0 && !buf_reserve(xfer, (size_t)content_len)) {
+            return 0;
+        }
+    }
+
+    if (buf->sz + chunk_sz > buf->cap) {
+        // Grow geometrically, so a big image without Content-Length costs log(n) reallocs
+        size_t cap = buf->cap * 2;
+        if (cap < buf->sz + chunk_sz) cap = buf->sz + chunk_sz;
+        if (cap < MIN_BUF_SZ) cap = MIN_BUF_SZ;
+        if (!buf_reserve(xfer, cap)) {
+            return 0;
+        }
+    }
+
+    memcpy(buf->data + buf->sz, ptr, chunk_sz);
+    buf->sz += chunk_sz;
+    xfer->bytes_copied += chunk_sz;
 
     return chunk_sz;
 }
 
-unsigned char* downloader_get_one(struct downloader_ctx* ctx, size_t* out_sz)
+// Called periodically by curl, even while a transfer is stalled
+static int xferinfo(void* usr, curl_off_t dltotal, curl_off_t dlnow,
+                    curl_off_t ultotal, curl_off_t ulnow)
 {
-    ctx->mem_buf = NULL;
-    ctx->mem_buf_sz = 0;
+    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+    struct dl_transfer* xfer = usr;
+    const atomic_bool* cancel = xfer->ctx->cancel;
+    // Non-zero aborts the transfer
+    return cancel && atomic_load(cancel) ? 1 : 0;
+}
 
-    const CURLcode ret = curl_easy_perform(ctx->curl_handle);
-    if (ret != CURLE_OK) {
-        fprintf(stderr, "Fail to download from %s: %s\n", ctx->www_url,
-               curl_easy_strerror(ret));
-        free(ctx->mem_buf);
-        ctx->mem_buf = NULL;
-        ctx->mem_buf_sz = 0;
-        *out_sz = 0;
+bool downloader_start(struct downloader_ctx* ctx, unsigned char* data, size_t cap,
+                      void* usr, const atomic_bool* cancel)
+{
+    struct dl_transfer* xfer = NULL;
+    for (size_t i = 0; i < ctx->max_parallel; ++i) {
+        if (!ctx->xfers[i].busy) {
+            xfer = &ctx->xfers[i];
+            break;
+        }
+    }
+    if (!xfer) {
+        return false;
+    }
+
+    xfer->buf.data = data;
+    xfer->buf.cap = data ? cap : 0;
+    xfer->buf.sz = 0;
+    xfer->buf.usr = usr;
+    xfer->allocs = 0;
+    xfer->bytes_copied = 0;
+    ctx->cancel = cancel;
+
+    CURLMcode ret = curl_multi_add_handle(ctx->multi_handle, xfer->curl_handle);
+    if (ret != CURLM_OK) {
+        fprintf(stderr, "Fail to start download from %s: %s\n", ctx->www_url,
+                curl_multi_strerror(ret));
+        return false;
+    }
+
+    xfer->busy = true;
+    ctx->in_flight++;
+    return true;
+}
+
+// Returns the next transfer curl says is done, or NULL
+static struct dl_transfer* pop_done(struct downloader_ctx* ctx, bool* ok)
+{
+    int msgs_left;
+    CURLMsg* msg;
+    while ((msg = curl_multi_info_read(ctx->multi_handle, &msgs_left))) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+
+        struct dl_transfer* xfer = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &xfer);
+
+        const CURLcode ret = msg->data.result;
+        long http_code = 0;
+        curl_easy_getinfo(xfer->curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
+        // msg is invalid after removing its handle
+        curl_multi_remove_handle(ctx->multi_handle, xfer->curl_handle);
+        xfer->busy = false;
+        ctx->in_flight--;
+
+        ctx->stats.allocs += xfer->allocs;
+        ctx->stats.bytes_copied += xfer->bytes_copied;
+        ctx->stats.last_img_allocs = xfer->allocs;
+        ctx->stats.last_img_bytes_copied = xfer->bytes_copied;
+
+        *ok = false;
+        if (http_code != 0 && http_code != 200) {
+            fprintf(stderr, "Download from %s returned %ld\n", ctx->www_url, http_code);
+        } else if (ret == CURLE_OK) {
+            *ok = true;
+            ctx->stats.images++;
+            printf("Downloaded %zu bytes: %zu allocs, %zu bytes copied\n",
+                   xfer->buf.sz, xfer->allocs, xfer->bytes_copied);
+        } else if (ret != CURLE_ABORTED_BY_CALLBACK) {
+            fprintf(stderr, "Fail to download from %s: %s\n", ctx->www_url,
+                   curl_easy_strerror(ret));
+        }
+
+        if (!*ok) {
+            xfer->buf.sz = 0;
+        }
+        return xfer;
+    }
+
+    return NULL;
+}
+
+const struct dl_buf* downloader_wait(struct downloader_ctx* ctx, int timeout_ms, bool* ok)
+{
+    *ok = false;
+    if (ctx->in_flight == 0) {
         return NULL;
     }
 
-    unsigned char* buf = ctx->mem_buf;
-    *out_sz = ctx->mem_buf_sz;
+    // Something may have finished during the last call
+    struct dl_transfer* xfer = pop_done(ctx, ok);
+    if (xfer) {
+        return &xfer->buf;
+    }
+
+    int running;
+    CURLMcode ret = curl_multi_perform(ctx->multi_handle, &running);
+    if (ret == CURLM_OK && running == (int)ctx->in_flight) {
+        ret = curl_multi_poll(ctx->multi_handle, NULL, 0, timeout_ms, NULL);
+        if (ret == CURLM_OK) {
+            ret = curl_multi_perform(ctx->multi_handle, &running);
+        }
+    }
+    if (ret != CURLM_OK) {
+        fprintf(stderr, "Download from %s failed: %s\n", ctx->www_url,
+                curl_multi_strerror(ret));
+    }
 
-    // Detach from ctx so caller owns it
-    ctx->mem_buf = NULL;
-    ctx->mem_buf_sz = 0;
+    xfer = pop_done(ctx, ok);
+    return xfer ? &xfer->buf : NULL;
+}
 
-    return buf;
+void downloader_get_stats(struct downloader_ctx* ctx, struct downloader_stats* out)
+{
+    *out = ctx->stats;
 }
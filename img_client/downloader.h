@@ -1,14 +1,73 @@
 #pragma once
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 
 struct downloader_ctx;
 
-struct downloader_ctx* downloader_init(const char* www_url);
+/**
+ * A download buffer. Buffers can be reused between downloads: data and cap are
+ * kept, and only grown when an image doesn't fit.
+ */
+struct dl_buf {
+    unsigned char* data;
+    size_t sz;   // Bytes downloaded
+    size_t cap;  // Allocated size of data
+    void* usr;   // Caller's tag, returned untouched
+};
+
+struct downloader_stats {
+    size_t images;
+    // Allocations (malloc or realloc) and bytes memcpy'd or moved by realloc
+    size_t allocs;
+    size_t bytes_copied;
+    size_t last_img_allocs;
+    size_t last_img_bytes_copied;
+};
+
+/**
+ * Creates a downloader that can run up to max_parallel transfers at the same
+ * time. All transfers share one connection cache and DNS cache, so refilling
+ * after the first image reuses connections instead of opening new ones.
+ * A transfer fails if it takes longer than timeout_ms, or earlier if it
+ * stalls for a good part of that (see downloader_set_timeouts).
+ * curl_global_init must have been called.
+ */
+struct downloader_ctx* downloader_init(const char* www_url, size_t max_parallel, long timeout_ms);
 void downloader_free(struct downloader_ctx* ctx);
 
-// Downloads an image to memory. Returns the buffer and sets *out_sz.
-// Caller takes ownership of the returned buffer (must free it).
-// Returns NULL on failure.
-unsigned char* downloader_get_one(struct downloader_ctx* ctx, size_t* out_sz);
+size_t downloader_in_flight(struct downloader_ctx* ctx);
+
+/**
+ * Starts downloading an image into data (may be NULL), which is reused if the
+ * image fits in cap bytes and realloc'd otherwise. Growing the buffer is
+ * accounted as MEM_DOWNLOAD, and the transfer is aborted if it doesn't fit in
+ * the memory budget. The downloader owns data
+ * until the transfer is returned by downloader_wait. If *cancel (optional) is
+ * set, transfers are aborted as soon as possible. Returns false if the
+ * transfer can't be started, eg because max_parallel are already running.
+ */
+bool downloader_start(struct downloader_ctx* ctx, unsigned char* data, size_t cap,
+                      void* usr, const atomic_bool* cancel);
+
+/**
+ * Runs transfers for up to timeout_ms, or until one of them ends, and returns
+ * it. *ok is false if it failed, timed out, was cancelled, or the server
+ * answered with something other than a 200. Ownership of buf->data goes
+ * back to the caller; the dl_buf itself is valid until the next call to
+ * downloader_start. Returns NULL if no transfer ended.
+ */
+const struct dl_buf* downloader_wait(struct downloader_ctx* ctx, int timeout_ms, bool* ok);
+
+// Not synchronized: call from the thread that runs downloads
+void downloader_get_stats(struct downloader_ctx* ctx, struct downloader_stats* out);
+
+/**
+ * Sets the deadlines of a curl easy handle for a transfer that must end
+ * within timeout_ms: connecting may take a part of it, and a transfer that
+ * receives (almost) nothing for a quarter of it is dropped early, so a
+ * stalled connection doesn't hold up a download slot until the deadline.
+ * Returns a CURLcode.
+ */
+int downloader_set_timeouts(void* curl_handle, long timeout_ms);
@@ -1,25 +1,152 @@
 #include "img_client.h"
+#include "../mem_budget.h"
+#include "../metrics.h"
+#include "../trace.h"
+#include "disk_cache.h"
 #include "downloader.h"
 #include "prefetcher.h"
 
 #include <curl/curl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
+// Images downloaded ahead: starts at PREFETCH_N, and adapts to how long downloads take
 #define PREFETCH_N 3
+#define PREFETCH_MIN_N 1
+#define PREFETCH_MAX_N 8
+// Downloads in flight at the same time. Keep at 1 for weak servers; more refills
+// the cache faster after a network hiccup.
+#define PREFETCH_PARALLEL 1
 #define MAX_URL_LEN 512
 
+// Registration requests give up after this long, and are retried with a
+// growing delay until the server answers
+#define REGISTER_CONNECT_TIMEOUT_SEC 5
+#define REGISTER_TIMEOUT_SEC 10
+#define REGISTER_RETRY_MIN_SEC 1
+#define REGISTER_RETRY_MAX_SEC 30
+
+// A download is given up on after this many image intervals, so a stalled
+// connection can't hold up prefetching for long. Bounded for very short or
+// very long intervals.
+#define DOWNLOAD_TIMEOUT_INTERVALS 2
+#define DOWNLOAD_TIMEOUT_MIN_SEC 5
+#define DOWNLOAD_TIMEOUT_MAX_SEC 60
+// After a failed download, the next one waits this long, doubling with each
+// failure in a row, up to an image interval
+#define DOWNLOAD_RETRY_MIN_MS 500
+
+// Anything smaller than this is an error page or junk, not an image
+#define MIN_IMAGE_BYTES 128
+// Some encoders pad JPEGs after the EOI marker
+#define JPEG_EOI_SEARCH_BYTES 32
+
 struct img_client_ctx {
+    struct img_client_cfg cfg;
+    char base_url[MAX_URL_LEN];
+    struct timespec init_time;
+
+    // Registration runs in the background. Once registered is set, img_url,
+    // dl and prefetcher are ready and never change again.
+    pthread_t register_thread;
+    bool register_thread_started;
+    atomic_bool stop;
+    atomic_bool registered;
+
+    char img_url[MAX_URL_LEN];
+    long dl_timeout_ms;
     struct downloader_ctx* dl;
     struct image_prefetcher_ctx* prefetcher;
+
+    // Images are stored here as they are downloaded, and shown from here while
+    // the server can't be reached. NULL if there's no cache.
+    struct disk_cache* disk_cache;
+    struct disk_cache_img cached_img;
+    // Set once a download works, cleared when one fails
+    atomic_bool server_ok;
+    // The last img_client_get_image found nothing prefetched. The render loop
+    // retries until there is an image, but that's a single miss.
+    bool missed;
+    // Written to when there may be a new image
+    int ready_fd;
 };
 
-static unsigned char* dl_callback(void* usr, size_t* out_sz) {
-    struct downloader_ctx* dl = usr;
-    return downloader_get_one(dl, out_sz);
+static void notify_ready(struct img_client_ctx* ctx) {
+    const uint64_t one = 1;
+    // Only fails if the counter would overflow, in which case it's readable anyway
+    if (write(ctx->ready_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("img_client ready notify");
+    }
+}
+
+// Runs in the prefetcher thread
+static void on_image_ready(void* usr) {
+    notify_ready(usr);
+}
+
+static bool dl_start(void* usr, struct prefetched_img* img, const atomic_bool* cancel) {
+    struct img_client_ctx* ctx = usr;
+    if (!downloader_start(ctx->dl, img->data, img->cap, img, cancel)) {
+        return false;
+    }
+    mem_budget_move(MEM_PREFETCH, MEM_DOWNLOAD, img->cap);
+    return true;
+}
+
+bool img_client_is_whole_image(const unsigned char* data, size_t sz) {
+    if (sz < MIN_IMAGE_BYTES) {
+        return false;
+    }
+    if (raw_frame_sniff(data, sz)) {
+        struct raw_frame_header hdr;
+        return raw_frame_parse_header(data, sz, &hdr) && sz == RAW_FRAME_HEADER_SZ + hdr.payload_sz;
+    }
+    if (data[0] != 0xFF || data[1] != 0xD8) {
+        return false;
+    }
+    for (size_t i = sz - 1; i > 0 && sz - i <= JPEG_EOI_SEARCH_BYTES; --i) {
+        if (data[i - 1] == 0xFF && data[i] == 0xD9) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs in the prefetcher thread
+static struct prefetched_img* dl_wait(void* usr, int timeout_ms) {
+    struct img_client_ctx* ctx = usr;
+    bool ok;
+    const struct dl_buf* buf = downloader_wait(ctx->dl, timeout_ms, &ok);
+    if (!buf) {
+        return NULL;
+    }
+
+    struct prefetched_img* img = buf->usr;
+    mem_budget_move(MEM_DOWNLOAD, MEM_PREFETCH, buf->cap);
+    // The buffer may have grown even if the download failed
+    img->data = buf->data;
+    img->cap = buf->cap;
+    if (ok && !img_client_is_whole_image(buf->data, buf->sz)) {
+        fprintf(stderr, "Downloaded %zu bytes, but not a whole image, dropping it\n", buf->sz);
+        ok = false;
+    }
+    img->sz = ok ? buf->sz : 0;
+
+    atomic_store(&ctx->server_ok, ok);
+    if (ok) {
+        disk_cache_put(ctx->disk_cache, img->data, img->sz);
+    }
+    return img;
 }
 
 struct curl_buf {
@@ -39,29 +166,56 @@ static size_t curl_buf_write(void* ptr, size_t size, size_t nmemb, void* usr) {
     return chunk;
 }
 
-// Simple HTTP GET that returns the response body as a null-terminated string.
-// Caller must free the result.
-static char* http_get(const char* url) {
+// Aborts a request in flight when the client is shutting down
+static int register_xferinfo(void* usr, curl_off_t dltotal, curl_off_t dlnow,
+                             curl_off_t ultotal, curl_off_t ulnow) {
+    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+    struct img_client_ctx* ctx = usr;
+    return atomic_load(&ctx->stop) ? 1 : 0;
+}
+
+// Creates the handle used for all registration requests. Reusing it keeps the
+// connection to the server open and its DNS lookup cached between requests.
+static CURL* register_handle_init(struct img_client_ctx* ctx) {
     CURL* curl = curl_easy_init();
     if (!curl) return NULL;
 
+    int ret = CURLE_OK;
+    ret = ret | curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_buf_write);
+    ret = ret | curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    ret = ret | curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, register_xferinfo);
+    ret = ret | curl_easy_setopt(curl, CURLOPT_XFERINFODATA, ctx);
+    ret = ret | curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)REGISTER_CONNECT_TIMEOUT_SEC);
+    ret = ret | curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)REGISTER_TIMEOUT_SEC);
+    ret = ret | curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    // Keep the server's address for as long as we keep retrying
+    ret = ret | curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+    if (ret != CURLE_OK) {
+        fprintf(stderr, "Failed to setup curl: %s\n", curl_easy_strerror(ret));
+        curl_easy_cleanup(curl);
+        return NULL;
+    }
+    return curl;
+}
+
+// Simple HTTP GET that returns the response body as a null-terminated string.
+// Caller must free the result.
+static char* http_get(CURL* curl, const char* url) {
     struct curl_buf buf = {NULL, 0};
     curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_buf_write);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
-    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
 
     CURLcode ret = curl_easy_perform(curl);
     if (ret != CURLE_OK) {
-        fprintf(stderr, "HTTP GET %s failed: %s\n", url, curl_easy_strerror(ret));
-        curl_easy_cleanup(curl);
+        if (ret != CURLE_ABORTED_BY_CALLBACK) {
+            fprintf(stderr, "HTTP GET %s failed: %s\n", url, curl_easy_strerror(ret));
+        }
         free(buf.data);
         return NULL;
     }
 
     long http_code = 0;
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-    curl_easy_cleanup(curl);
 
     if (http_code != 200) {
         fprintf(stderr, "HTTP GET %s returned %ld\n", url, http_code);
@@ -72,12 +226,62 @@ static char* http_get(const char* url) {
     return buf.data;
 }
 
-static bool register_client(const char* base_url, int screen_w, int screen_h, char* img_url, size_t img_url_sz) {
+// Like snprintf, but a truncated URL would point somewhere else: returns false if it doesn't fit
+__attribute__((format(printf, 3, 4)))
+static bool format_url(char* url, size_t url_sz, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(url, url_sz, fmt, args);
+    va_end(args);
+    if (n < 0 || (size_t)n >= url_sz) {
+        fprintf(stderr, "URL too long: %s\n", url);
+        return false;
+    }
+    return true;
+}
+
+// Sets a client_cfg key on the server, returns false if it's not supported
+static bool set_client_cfg(CURL* curl, const char* base_url, const char* client_id,
+                           const char* key, const char* val) {
+    char url[MAX_URL_LEN];
+    if (!format_url(url, MAX_URL_LEN, "%s/client_cfg/%s/%s/%s", base_url, client_id, key, val)) {
+        return false;
+    }
+    char* resp = http_get(curl, url);
+    if (!resp) {
+        return false;
+    }
+    printf("Set %s %s: %s\n", key, val, resp);
+    free(resp);
+    return true;
+}
+
+// Asks for raw frames. Failing is fine: the server will send JPEGs.
+static void request_raw_frames(CURL* curl, const char* base_url, const char* client_id,
+                               const struct img_client_cfg* cfg) {
+    if (cfg->raw_format == RAW_FRAME_NONE) {
+        return;
+    }
+    char gamma[32];
+    snprintf(gamma, sizeof(gamma), "%g", cfg->raw_gamma);
+    if (!set_client_cfg(curl, base_url, client_id, "raw_format", raw_frame_format_name(cfg->raw_format)) ||
+        !set_client_cfg(curl, base_url, client_id, "raw_compression",
+                        raw_frame_compression_name(cfg->raw_compression)) ||
+        !set_client_cfg(curl, base_url, client_id, "raw_gamma", gamma)) {
+        fprintf(stderr, "Image server doesn't support %s frames, will use JPEG\n",
+                raw_frame_format_name(cfg->raw_format));
+    }
+}
+
+static bool register_client(CURL* curl, const char* base_url, const struct img_client_cfg* cfg,
+                            char* img_url, size_t img_url_sz) {
     char url[MAX_URL_LEN];
 
     // Register and get client id
-    snprintf(url, MAX_URL_LEN, "%s/client_register", base_url);
-    char* client_id = http_get(url);
+    if (!format_url(url, MAX_URL_LEN, "%s/client_register", base_url)) {
+        return false;
+    }
+    char* client_id = http_get(curl, url);
     if (!client_id) {
         fprintf(stderr, "Failed to register with image server\n");
         return false;
@@ -90,8 +294,10 @@ static bool register_client(const char* base_url, int screen_w, int screen_h, ch
     printf("Registered with image server as client %s\n", client_id);
 
     // Configure target size
-    snprintf(url, MAX_URL_LEN, "%s/client_cfg/%s/target_size/%dx%d", base_url, client_id, screen_w, screen_h);
-    char* resp = http_get(url);
+    char* resp = NULL;
+    if (format_url(url, MAX_URL_LEN, "%s/client_cfg/%s/target_size/%dx%d", base_url, client_id, cfg->screen_w, cfg->screen_h)) {
+        resp = http_get(curl, url);
+    }
     if (resp) {
         printf("Set target size: %s\n", resp);
         free(resp);
@@ -100,8 +306,10 @@ static bool register_client(const char* base_url, int screen_w, int screen_h, ch
     }
 
     // Disable QR code
-    snprintf(url, MAX_URL_LEN, "%s/client_cfg/%s/embed_info_qr_code/false", base_url, client_id);
-    resp = http_get(url);
+    resp = NULL;
+    if (format_url(url, MAX_URL_LEN, "%s/client_cfg/%s/embed_info_qr_code/false", base_url, client_id)) {
+        resp = http_get(curl, url);
+    }
     if (resp) {
         printf("Disabled QR code: %s\n", resp);
         free(resp);
@@ -109,40 +317,136 @@ static bool register_client(const char* base_url, int screen_w, int screen_h, ch
         fprintf(stderr, "Failed to disable image qr code in image server\n");
     }
 
+    request_raw_frames(curl, base_url, client_id, cfg);
+
     // Build the image fetch URL
-    snprintf(img_url, img_url_sz, "%s/get_next_img/%s", base_url, client_id);
+    bool ok = format_url(img_url, img_url_sz, "%s/get_next_img/%s", base_url, client_id);
     free(client_id);
-    return true;
+    return ok;
 }
 
-struct img_client_ctx* img_client_init(int screen_w, int screen_h,
-                                       const char* image_server_url) {
-    struct img_client_ctx* ctx = malloc(sizeof(struct img_client_ctx));
-    if (!ctx) {
-        return NULL;
+static double ms_since(const struct timespec* t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+// Sleeps for up to sec, returns false if the client is shutting down
+static bool register_backoff(struct img_client_ctx* ctx, int sec) {
+    for (int i = 0; i < sec * 10; ++i) {
+        if (atomic_load(&ctx->stop)) return false;
+        usleep(100 * 1000);
     }
+    return !atomic_load(&ctx->stop);
+}
 
-    char img_url[MAX_URL_LEN];
-    if (!register_client(image_server_url, screen_w, screen_h, img_url, MAX_URL_LEN)) {
-        free(ctx);
+static void* register_thread(void* usr) {
+    struct img_client_ctx* ctx = usr;
+    trace_thread_name("register");
+
+    CURL* curl = register_handle_init(ctx);
+    if (!curl) {
+        fprintf(stderr, "Failed to create curl handle, can't register with image server\n");
         return NULL;
     }
 
-    printf("Registered with image server, will fetch from '%s'\n", img_url);
+    int retry_sec = REGISTER_RETRY_MIN_SEC;
+    uint64_t trace_t = trace_begin();
+    while (!register_client(curl, ctx->base_url, &ctx->cfg, ctx->img_url, MAX_URL_LEN)) {
+        trace_end("register", trace_t);
+        if (!register_backoff(ctx, retry_sec)) {
+            curl_easy_cleanup(curl);
+            return NULL;
+        }
+        retry_sec = retry_sec * 2 > REGISTER_RETRY_MAX_SEC ? REGISTER_RETRY_MAX_SEC : retry_sec * 2;
+        trace_t = trace_begin();
+    }
+    trace_end("register", trace_t);
+    curl_easy_cleanup(curl);
+
+    printf("Registered with image server after %.1f ms, will fetch from '%s'\n",
+           ms_since(&ctx->init_time), ctx->img_url);
 
-    ctx->dl = downloader_init(img_url);
+    // One more transfer for hedging, see image_prefetcher_cfg
+    ctx->dl = downloader_init(ctx->img_url, PREFETCH_PARALLEL + (ctx->cfg.hedge_downloads ? 1 : 0),
+                              ctx->dl_timeout_ms);
     if (!ctx->dl) {
-        free(ctx);
         return NULL;
     }
 
-    ctx->prefetcher = image_prefetcher_init(dl_callback, ctx->dl, PREFETCH_N);
+    const unsigned retry_max_ms = ctx->cfg.image_interval_sec * 1000;
+    const struct image_prefetcher_cfg prefetch_cfg = {
+        .min_n = PREFETCH_MIN_N,
+        .max_n = PREFETCH_MAX_N,
+        .initial_n = PREFETCH_N,
+        .max_parallel = PREFETCH_PARALLEL,
+        .consume_interval_ms = ctx->cfg.image_interval_sec * 1000,
+        .max_mem_bytes = ctx->cfg.prefetch_max_bytes,
+        .retry_min_ms = DOWNLOAD_RETRY_MIN_MS,
+        .retry_max_ms = retry_max_ms > DOWNLOAD_RETRY_MIN_MS ? retry_max_ms : DOWNLOAD_RETRY_MIN_MS,
+        .hedge = ctx->cfg.hedge_downloads,
+        .on_image_ready = on_image_ready,
+    };
+    ctx->prefetcher = image_prefetcher_init(dl_start, dl_wait, ctx, &prefetch_cfg);
     if (!ctx->prefetcher) {
         downloader_free(ctx->dl);
+        ctx->dl = NULL;
+        return NULL;
+    }
+
+    // Publishes img_url, dl and prefetcher to the render thread
+    atomic_store_explicit(&ctx->registered, true, memory_order_release);
+    notify_ready(ctx);
+    return NULL;
+}
+
+struct img_client_ctx* img_client_init(const struct img_client_cfg* cfg) {
+    struct img_client_ctx* ctx = calloc(1, sizeof(struct img_client_ctx));
+    if (!ctx) {
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ctx->init_time);
+    ctx->cfg = *cfg;
+    snprintf(ctx->base_url, MAX_URL_LEN, "%s", cfg->server_url);
+    // Don't keep pointers to the caller's memory
+    ctx->cfg.server_url = NULL;
+    ctx->cfg.cache_dir = NULL;
+    long timeout_sec = (long)cfg->image_interval_sec * DOWNLOAD_TIMEOUT_INTERVALS;
+    if (timeout_sec < DOWNLOAD_TIMEOUT_MIN_SEC) timeout_sec = DOWNLOAD_TIMEOUT_MIN_SEC;
+    if (timeout_sec > DOWNLOAD_TIMEOUT_MAX_SEC) timeout_sec = DOWNLOAD_TIMEOUT_MAX_SEC;
+    ctx->dl_timeout_ms = timeout_sec * 1000;
+    atomic_init(&ctx->stop, false);
+    atomic_init(&ctx->registered, false);
+    atomic_init(&ctx->server_ok, false);
+
+    ctx->ready_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ctx->ready_fd < 0) {
+        perror("eventfd");
+        free(ctx);
+        return NULL;
+    }
+
+    // Not thread safe: do it once, before any thread uses curl
+    const CURLcode ret = curl_global_init(CURL_GLOBAL_ALL);
+    if (ret != CURLE_OK) {
+        fprintf(stderr, "Failed to global init curl: %s\n", curl_easy_strerror(ret));
+        close(ctx->ready_fd);
         free(ctx);
         return NULL;
     }
 
+    ctx->disk_cache = disk_cache_init(cfg->cache_dir, cfg->cache_max_bytes);
+    if (cfg->cache_dir && !ctx->disk_cache) {
+        fprintf(stderr, "Image cache disabled: nothing will be shown while the image server is down\n");
+    }
+
+    if (pthread_create(&ctx->register_thread, NULL, register_thread, ctx) != 0) {
+        perror("pthread_create");
+        img_client_free(ctx);
+        return NULL;
+    }
+    ctx->register_thread_started = true;
+
     return ctx;
 }
 
@@ -150,19 +454,63 @@ void img_client_free(struct img_client_ctx* ctx) {
     if (!ctx) {
         return;
     }
+    if (ctx->register_thread_started) {
+        atomic_store(&ctx->stop, true);
+        pthread_join(ctx->register_thread, NULL);
+    }
     image_prefetcher_free(ctx->prefetcher);
     downloader_free(ctx->dl);
+    disk_cache_unmap(&ctx->cached_img);
+    disk_cache_free(ctx->disk_cache);
+    curl_global_cleanup();
+    close(ctx->ready_fd);
     free(ctx);
 }
 
+int img_client_get_ready_fd(struct img_client_ctx* ctx) {
+    return ctx->ready_fd;
+}
+
+static bool is_registered(struct img_client_ctx* ctx) {
+    return atomic_load_explicit(&ctx->registered, memory_order_acquire);
+}
+
 bool img_client_get_image(struct img_client_ctx* ctx,
                           const unsigned char** data, size_t* sz) {
-    struct prefetched_img* img = image_prefetcher_jump_next(ctx->prefetcher);
-    if (!img || !img->data) {
-        return false;
+    // The previous image is done with
+    disk_cache_unmap(&ctx->cached_img);
+
+    struct prefetched_img* img = is_registered(ctx) ? image_prefetcher_jump_next(ctx->prefetcher) : NULL;
+    if (img) {
+        metrics_inc(METRIC_PREFETCH_HITS, 1);
+        ctx->missed = false;
+        *data = img->data;
+        *sz = img->sz;
+        return true;
+    }
+    if (!ctx->missed) {
+        metrics_inc(METRIC_PREFETCH_MISSES, 1);
+        ctx->missed = true;
     }
 
-    *data = img->data;
-    *sz = img->sz;
+    // Nothing downloaded: if the server is down, or we haven't heard from it
+    // yet (eg just after startup), show a cached image instead of nothing
+    if (atomic_load(&ctx->server_ok) || !ctx->disk_cache) {
+        return false;
+    }
+    if (!disk_cache_map_next(ctx->disk_cache, &ctx->cached_img)) {
+        return false;
+    }
+    printf("Showing cached image\n");
+    metrics_inc(METRIC_DISK_CACHE_IMAGES, 1);
+    *data = ctx->cached_img.data;
+    *sz = ctx->cached_img.sz;
     return true;
 }
+
+struct img_stream* img_client_stream_image(struct img_client_ctx* ctx) {
+    if (!is_registered(ctx)) {
+        return NULL;
+    }
+    return img_stream_open(ctx->img_url, ctx->dl_timeout_ms);
+}
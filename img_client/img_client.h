@@ -3,16 +3,73 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "../raw_frame.h"
+#include "img_stream.h"
+
 struct img_client_ctx;
 
-struct img_client_ctx* img_client_init(int screen_w, int screen_h,
-                                       const char* image_server_url);
+struct img_client_cfg {
+    const char* server_url;
+    int screen_w;
+    int screen_h;
+    // How often an image is shown, so the prefetcher can keep up
+    unsigned image_interval_sec;
+    // Fewer images are prefetched if they wouldn't fit in this. 0 for no limit.
+    size_t prefetch_max_bytes;
+    // Downloaded images are also kept here, up to cache_max_bytes, and shown
+    // when the server can't be reached. Created if missing. NULL to disable.
+    const char* cache_dir;
+    size_t cache_max_bytes;
+    // Ask the server for frames ready for the screen instead of JPEGs (see
+    // raw_frame.h), or RAW_FRAME_NONE for JPEGs. Servers that don't support
+    // it keep sending JPEGs, so images may come in either format.
+    enum raw_frame_format raw_format;
+    enum raw_frame_compression raw_compression;
+    // Applied by the server to gray8 frames
+    double raw_gamma;
+    // If a download is much slower than usual and nothing is prefetched,
+    // start a second one next to it instead of only waiting
+    bool hedge_downloads;
+};
+
+/**
+ * Starts registering with the image server, in the background, and then
+ * prefetching. Never blocks on the network: until the server answers, only
+ * cached images are available.
+ */
+struct img_client_ctx* img_client_init(const struct img_client_cfg* cfg);
 void img_client_free(struct img_client_ctx* ctx);
 
+/**
+ * An eventfd that becomes readable when there may be a new image: one was
+ * prefetched, or registration finished so images can be streamed. Lets the
+ * caller sleep (eg in epoll) instead of polling img_client_get_image. Read it
+ * to clear it.
+ */
+int img_client_get_ready_fd(struct img_client_ctx* ctx);
+
 /**
  * Returns the next image if one is available.
- * Returns true if an image was available, false otherwise.
- * data/sz point into prefetcher-owned memory, valid until the next call.
+ * Returns true if an image was available, false otherwise. If the image
+ * server is unreachable, images come from the disk cache.
+ * data/sz point into memory owned by img_client, valid until the next call.
  */
 bool img_client_get_image(struct img_client_ctx* ctx,
                           const unsigned char** data, size_t* sz);
+
+/**
+ * True if data looks like a whole image: a raw frame with all of its payload,
+ * or a JPEG from SOI to EOI (with maybe some padding after it), and not
+ * implausibly small. Downloads that fail this are dropped, as they are a
+ * truncated transfer or not an image.
+ */
+bool img_client_is_whole_image(const unsigned char* data, size_t sz);
+
+/**
+ * Starts downloading a new image outside of the prefetcher, to decode it while
+ * it arrives. Meant for when there is nothing prefetched yet (eg the first
+ * image after startup). Returns NULL if not registered with the server yet.
+ * The transfer has the same deadline as prefetched downloads. Caller must
+ * img_stream_close the result.
+ */
+struct img_stream* img_client_stream_image(struct img_client_ctx* ctx);
@@ -0,0 +1,238 @@
+#include "img_stream.h"
+#include "../mem_budget.h"
+#include "downloader.h"
+
+#include <curl/curl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct stream_chunk {
+    struct stream_chunk* next;
+    size_t sz;
+    unsigned char data[];
+};
+
+struct img_stream {
+    char* url;
+    CURL* curl_handle;
+    pthread_t thread;
+    atomic_bool abort;
+
+    pthread_mutex_t mut;
+    pthread_cond_t cv;
+    struct stream_chunk* head;
+    struct stream_chunk* tail;
+    // Next chunk to hand to the reader; NULL if the reader caught up
+    struct stream_chunk* unread;
+    size_t total_sz;
+    bool done;
+    bool failed;
+};
+
+static void* img_stream_thread(void* usr);
+
+static size_t stream_write(void* ptr, size_t size, size_t nmemb, void* usr)
+{
+    struct img_stream* st = usr;
+    size_t chunk_sz = size * nmemb;
+    if (atomic_load(&st->abort)) {
+        return 0;
+    }
+
+    // Don't hand error pages to the decoder
+    long http_code = 0;
+    curl_easy_getinfo(st->curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code != 200) {
+        return 0;
+    }
+
+    if (!mem_budget_reserve(MEM_STREAM, chunk_sz)) {
+        fprintf(stderr, "Fail to stream download, image doesn't fit in memory budget\n");
+        return 0;
+    }
+    struct stream_chunk* c = malloc(sizeof(struct stream_chunk) + chunk_sz);
+    if (!c) {
+        fprintf(stderr, "Fail to stream download, bad alloc\n");
+        mem_budget_release(MEM_STREAM, chunk_sz);
+        return 0;
+    }
+    c->next = NULL;
+    c->sz = chunk_sz;
+    memcpy(c->data, ptr, chunk_sz);
+
+    pthread_mutex_lock(&st->mut);
+    if (st->tail) {
+        st->tail->next = c;
+    } else {
+        st->head = c;
+    }
+    st->tail = c;
+    if (!st->unread) {
+        st->unread = c;
+    }
+    st->total_sz += chunk_sz;
+    pthread_cond_signal(&st->cv);
+    pthread_mutex_unlock(&st->mut);
+
+    return chunk_sz;
+}
+
+static int stream_xferinfo(void* usr, curl_off_t dltotal, curl_off_t dlnow,
+                           curl_off_t ultotal, curl_off_t ulnow)
+{
+    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+    struct img_stream* st = usr;
+    // Non-zero aborts the transfer, even if it's stalled waiting for data
+    return atomic_load(&st->abort) ? 1 : 0;
+}
+
+struct img_stream* img_stream_open(const char* url, long timeout_ms)
+{
+    struct img_stream* st = calloc(1, sizeof(struct img_stream));
+    if (!st) {
+        fprintf(stderr, "bad alloc\n");
+        return NULL;
+    }
+    atomic_init(&st->abort, false);
+
+    st->url = strdup(url);
+    st->curl_handle = curl_easy_init();
+    if (!st->url || !st->curl_handle) {
+        fprintf(stderr, "Failed to create stream for %s\n", url);
+        curl_easy_cleanup(st->curl_handle);
+        free(st->url);
+        free(st);
+        return NULL;
+    }
+
+    int ret = CURLE_OK;
+    ret = ret | curl_easy_setopt(st->curl_handle, CURLOPT_VERBOSE, 0L);
+    ret = ret | curl_easy_setopt(st->curl_handle, CURLOPT_NOPROGRESS, 0L);
+    ret = ret | curl_easy_setopt(st->curl_handle, CURLOPT_XFERINFOFUNCTION, stream_xferinfo);
+    ret = ret | curl_easy_setopt(st->curl_handle, CURLOPT_XFERINFODATA, st);
+    ret = ret | curl_easy_setopt(st->curl_handle, CURLOPT_WRITEFUNCTION, stream_write);
+    ret = ret | curl_easy_setopt(st->curl_handle, CURLOPT_WRITEDATA, st);
+    ret = ret | curl_easy_setopt(st->curl_handle, CURLOPT_URL, st->url);
+    ret = ret | downloader_set_timeouts(st->curl_handle, timeout_ms);
+    if (ret != CURLE_OK) {
+        fprintf(stderr, "Failed to setup curl: %s\n", curl_easy_strerror(ret));
+        curl_easy_cleanup(st->curl_handle);
+        free(st->url);
+        free(st);
+        return NULL;
+    }
+
+    pthread_mutex_init(&st->mut, NULL);
+    pthread_cond_init(&st->cv, NULL);
+
+    if (pthread_create(&st->thread, NULL, img_stream_thread, st) != 0) {
+        perror("pthread_create");
+        pthread_cond_destroy(&st->cv);
+        pthread_mutex_destroy(&st->mut);
+        curl_easy_cleanup(st->curl_handle);
+        free(st->url);
+        free(st);
+        return NULL;
+    }
+
+    return st;
+}
+
+void img_stream_close(struct img_stream* st)
+{
+    if (!st) {
+        return;
+    }
+
+    atomic_store(&st->abort, true);
+    pthread_join(st->thread, NULL);
+
+    pthread_cond_destroy(&st->cv);
+    pthread_mutex_destroy(&st->mut);
+    curl_easy_cleanup(st->curl_handle);
+
+    struct stream_chunk* c = st->head;
+    while (c) {
+        struct stream_chunk* next = c->next;
+        mem_budget_release(MEM_STREAM, c->sz);
+        free(c);
+        c = next;
+    }
+
+    free(st->url);
+    free(st);
+}
+
+static void* img_stream_thread(void* usr)
+{
+    struct img_stream* st = usr;
+    const CURLcode ret = curl_easy_perform(st->curl_handle);
+
+    long http_code = 0;
+    curl_easy_getinfo(st->curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code != 0 && http_code != 200) {
+        fprintf(stderr, "Stream from %s returned %ld\n", st->url, http_code);
+    } else if (ret != CURLE_OK && !atomic_load(&st->abort)) {
+        fprintf(stderr, "Fail to stream from %s: %s\n", st->url, curl_easy_strerror(ret));
+    }
+
+    pthread_mutex_lock(&st->mut);
+    st->done = true;
+    st->failed = ret != CURLE_OK || http_code != 200;
+    pthread_cond_signal(&st->cv);
+    pthread_mutex_unlock(&st->mut);
+
+    return NULL;
+}
+
+ssize_t img_stream_next(struct img_stream* st, const unsigned char** chunk, int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    ssize_t ret = -1;
+    pthread_mutex_lock(&st->mut);
+    while (!st->unread && !st->done) {
+        if (pthread_cond_timedwait(&st->cv, &st->mut, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    if (st->unread) {
+        *chunk = st->unread->data;
+        ret = st->unread->sz;
+        st->unread = st->unread->next;
+    } else if (st->done) {
+        ret = 0;
+    }
+    pthread_mutex_unlock(&st->mut);
+
+    return ret;
+}
+
+bool img_stream_failed(struct img_stream* st)
+{
+    pthread_mutex_lock(&st->mut);
+    bool failed = st->failed;
+    pthread_mutex_unlock(&st->mut);
+    return failed;
+}
+
+size_t img_stream_size(struct img_stream* st)
+{
+    pthread_mutex_lock(&st->mut);
+    size_t sz = st->total_sz;
+    pthread_mutex_unlock(&st->mut);
+    return sz;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Downloads a single image in a background thread, and hands out the bytes as
+ * they arrive so they can be decoded while the transfer is still running.
+ * Chunks are never moved or freed until the stream is closed.
+ */
+struct img_stream;
+
+// The transfer fails if it takes longer than timeout_ms, or stalls (see downloader_set_timeouts)
+struct img_stream* img_stream_open(const char* url, long timeout_ms);
+
+/**
+ * Aborts the transfer if it's still running and frees all chunks.
+ */
+void img_stream_close(struct img_stream* st);
+
+/**
+ * Waits up to timeout_ms for the next chunk of data. Returns its size (> 0)
+ * and sets *chunk, 0 if the transfer is over (see img_stream_failed) or -1 if
+ * no data arrived in time.
+ */
+ssize_t img_stream_next(struct img_stream* st, const unsigned char** chunk, int timeout_ms);
+
+/**
+ * True if the transfer ended with an error. Only meaningful once
+ * img_stream_next returned 0.
+ */
+bool img_stream_failed(struct img_stream* st);
+
+/**
+ * Bytes received so far.
+ */
+size_t img_stream_size(struct img_stream* st);
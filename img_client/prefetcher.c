@@ -1,76 +1,169 @@
 #include "prefetcher.h"
+#include "../mem_budget.h"
+#include "../metrics.h"
+#include "../trace.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
 static void* image_prefetcher_thread(void* usr);
 
+/**
+ * The cache is a single producer (prefetcher thread), single consumer (render
+ * thread) ring. Each side only writes its own index, and publishes it with a
+ * release store after it's done with the slot, so no locks are needed. The
+ * producer sleeps on an eventfd, which the consumer pokes after taking an
+ * image and image_prefetcher_free pokes to stop the thread.
+ *
+ * Up to max_parallel downloads run at once, each into its own buffer, and are
+ * published to the ring as they complete. The producer never has more images
+ * cached or in flight than the current depth, which is never more than the
+ * ring can hold, so a completed download always has a free slot.
+ *
+ * The depth adapts to how long downloads take: see update_depth. The ring is
+ * sized for max_n, but memory follows the depth: image buffers live in the
+ * slots that hold images, and once the consumer is done with a slot the
+ * producer reclaims its buffer into a small pool (or frees it, if the pool is
+ * full). Downloads take their buffer from the pool, so in steady state they
+ * reuse buffers of images already shown and don't allocate.
+ */
+struct dl_slot {
+    struct prefetched_img img;
+    bool in_flight;
+    bool hedged;  // Another download was started because this one is slow
+    struct timespec started;
+    uint64_t trace_started;
+};
+
 struct image_prefetcher_ctx {
-    downloader_cb downloader_impl;
+    download_start_cb download_start;
+    download_wait_cb download_wait;
     void* downloader_impl_usr;
+    struct image_prefetcher_cfg cfg;
 
     pthread_t thread;
-    pthread_cond_t condvar;
-    pthread_mutex_t cv_mut;
+    bool thread_started;
+    int wake_fd;
+    atomic_bool stop;
 
     size_t cache_size;
     struct prefetched_img* cache;  // ring buffer of images
-    size_t cache_r;                // read index
-    size_t cache_w;                // write index
-    size_t prefetch_n;
-
+    struct timespec* cache_ready;  // when each image in the ring was published
+    atomic_size_t cache_r;         // read index, only written by the consumer
+    atomic_size_t cache_w;         // write index, only written by the producer
+    atomic_size_t depth;           // only written by the producer
+
+    // Only used by the producer
+    struct dl_slot* dl_slots;      // max_parallel, then the hedge slot if cfg.hedge
+    size_t n_slots;
+    size_t in_flight;
+    size_t reclaim;                // next slot to reclaim once the consumer is done with it
+    struct prefetched_img* pool;   // n_slots free buffers
+    size_t pool_n;
+    unsigned failures;             // Failed downloads in a row
+    struct timespec retry_at;      // No downloads start before this, if failures > 0
+    bool have_samples;
+    double dl_ms_avg;
+    double dl_ms_dev;
+    double img_sz_avg;
 };
 
+// How long to wait for a download before checking if the consumer freed a slot, or if it's slow
+// enough to hedge
+#define DOWNLOAD_POLL_MS 100
+
+// Downloads are never hedged before this, however fast they usually are
+#define HEDGE_MIN_MS 500
+
+// Weight of the latest download in the moving averages
+#define EWMA_ALPHA 0.25
+
 static void cache_entry_free(struct prefetched_img* img) {
     free(img->data);
+    mem_budget_release(MEM_PREFETCH, img->cap);
     img->data = NULL;
     img->sz = 0;
+    img->cap = 0;
+}
+
+static void wake_producer(struct image_prefetcher_ctx* ctx) {
+    const uint64_t one = 1;
+    // Can only fail if the counter would overflow, in which case the producer is awake anyway
+    if (write(ctx->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("prefetcher wake");
+    }
 }
 
-struct image_prefetcher_ctx* image_prefetcher_init(downloader_cb cb,
+struct image_prefetcher_ctx* image_prefetcher_init(download_start_cb start_cb,
+                                                   download_wait_cb wait_cb,
                                                    void* downloader_impl_usr,
-                                                   size_t prefetch_n)
+                                                   const struct image_prefetcher_cfg* cfg)
 {
-    if (prefetch_n == 0) {
-        fprintf(stderr, "Can't use prefetcher with prefetch count = 0\n");
+    if (cfg->min_n == 0 || cfg->max_n < cfg->min_n) {
+        fprintf(stderr, "Can't use prefetcher with prefetch count %zu to %zu\n", cfg->min_n, cfg->max_n);
         return NULL;
     }
 
-    struct image_prefetcher_ctx* ctx = malloc(sizeof(struct image_prefetcher_ctx));
-    if (!ctx) {
+    if (cfg->max_parallel == 0) {
+        fprintf(stderr, "Can't use prefetcher with max parallel downloads = 0\n");
         return NULL;
     }
 
-    ctx->downloader_impl = cb;
-    ctx->downloader_impl_usr = downloader_impl_usr;
-    ctx->thread = 0;
-    // +1 so the ring buffer can distinguish full from empty
-    ctx->cache_size = prefetch_n + 1;
-    ctx->cache_r = 0;
-    ctx->cache_w = 0;
-    ctx->prefetch_n = prefetch_n;
-
-    if (pthread_cond_init(&ctx->condvar, NULL) != 0) {
-        perror("pthread_cond_init");
-        free(ctx);
+    struct image_prefetcher_ctx* ctx = calloc(1, sizeof(struct image_prefetcher_ctx));
+    if (!ctx) {
         return NULL;
     }
 
-    if (pthread_mutex_init(&ctx->cv_mut, NULL) != 0) {
-        perror("pthread_mutex_init");
-        pthread_cond_destroy(&ctx->condvar);
+    ctx->download_start = start_cb;
+    ctx->download_wait = wait_cb;
+    ctx->downloader_impl_usr = downloader_impl_usr;
+    ctx->cfg = *cfg;
+    if (ctx->cfg.max_parallel > ctx->cfg.max_n) {
+        ctx->cfg.max_parallel = ctx->cfg.max_n;
+    }
+    if (ctx->cfg.initial_n < ctx->cfg.min_n) ctx->cfg.initial_n = ctx->cfg.min_n;
+    if (ctx->cfg.initial_n > ctx->cfg.max_n) ctx->cfg.initial_n = ctx->cfg.max_n;
+
+    ctx->thread_started = false;
+    atomic_init(&ctx->stop, false);
+    // +1 so the ring buffer can distinguish full from empty. This also means the
+    // slot just before the read index, which the consumer may still be using,
+    // is never overwritten.
+    ctx->cache_size = ctx->cfg.max_n + 1;
+    atomic_init(&ctx->cache_r, 0);
+    atomic_init(&ctx->cache_w, 0);
+    atomic_init(&ctx->depth, ctx->cfg.initial_n);
+    // The slot before the read index is the one the consumer holds
+    ctx->reclaim = ctx->cache_size - 1;
+
+    ctx->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ctx->wake_fd < 0) {
+        perror("eventfd");
         free(ctx);
         return NULL;
     }
 
     ctx->cache = calloc(ctx->cache_size, sizeof(struct prefetched_img));
-    if (!ctx->cache) {
+    ctx->cache_ready = calloc(ctx->cache_size, sizeof(struct timespec));
+    ctx->n_slots = ctx->cfg.max_parallel + (ctx->cfg.hedge ? 1 : 0);
+    ctx->dl_slots = calloc(ctx->n_slots, sizeof(struct dl_slot));
+    ctx->pool = calloc(ctx->n_slots, sizeof(struct prefetched_img));
+    if (!ctx->cache || !ctx->cache_ready || !ctx->dl_slots || !ctx->pool) {
         fprintf(stderr, "Bad alloc, can't create prefetcher\n");
-        pthread_mutex_destroy(&ctx->cv_mut);
-        pthread_cond_destroy(&ctx->condvar);
+        free(ctx->cache);
+        free(ctx->cache_ready);
+        free(ctx->dl_slots);
+        free(ctx->pool);
+        close(ctx->wake_fd);
         free(ctx);
         return NULL;
     }
@@ -78,11 +171,14 @@ struct image_prefetcher_ctx* image_prefetcher_init(downloader_cb cb,
     if (pthread_create(&ctx->thread, NULL, image_prefetcher_thread, ctx) != 0) {
         perror("pthread_create");
         free(ctx->cache);
-        pthread_mutex_destroy(&ctx->cv_mut);
-        pthread_cond_destroy(&ctx->condvar);
+        free(ctx->cache_ready);
+        free(ctx->dl_slots);
+        free(ctx->pool);
+        close(ctx->wake_fd);
         free(ctx);
         return NULL;
     }
+    ctx->thread_started = true;
 
     return ctx;
 }
@@ -93,13 +189,14 @@ void image_prefetcher_free(struct image_prefetcher_ctx* ctx)
         return;
     }
 
-    if (ctx->thread) {
-        pthread_cancel(ctx->thread);
+    if (ctx->thread_started) {
+        // The downloader sees the flag too, and aborts any transfer in flight
+        atomic_store(&ctx->stop, true);
+        wake_producer(ctx);
         pthread_join(ctx->thread, NULL);
     }
 
-    pthread_cond_destroy(&ctx->condvar);
-    pthread_mutex_destroy(&ctx->cv_mut);
+    close(ctx->wake_fd);
 
     if (ctx->cache) {
         for (size_t i = 0; i < ctx->cache_size; ++i) {
@@ -107,87 +204,355 @@ void image_prefetcher_free(struct image_prefetcher_ctx* ctx)
         }
         free(ctx->cache);
     }
+    free(ctx->cache_ready);
+    // The thread waited for all downloads to end, so all buffers are ours
+    for (size_t i = 0; i < ctx->n_slots; ++i) {
+        cache_entry_free(&ctx->dl_slots[i].img);
+    }
+    for (size_t i = 0; i < ctx->pool_n; ++i) {
+        cache_entry_free(&ctx->pool[i]);
+    }
+    free(ctx->dl_slots);
+    free(ctx->pool);
 
     free(ctx);
 }
 
-static size_t cached_count_locked(struct image_prefetcher_ctx* ctx) {
-    if (ctx->cache_w >= ctx->cache_r)
-        return ctx->cache_w - ctx->cache_r;
-    return ctx->cache_w + ctx->cache_size - ctx->cache_r;
+static size_t cached_count(struct image_prefetcher_ctx* ctx, size_t r, size_t w) {
+    if (w >= r)
+        return w - r;
+    return w + ctx->cache_size - r;
 }
 
-void* image_prefetcher_thread(void* usr)
+// Sleeps until the consumer takes an image, timeout_ms pass (-1 to wait forever) or we're asked to stop
+static void wait_for_wake(struct image_prefetcher_ctx* ctx, int timeout_ms)
 {
-    struct image_prefetcher_ctx* ctx = usr;
+    uint64_t trace_t = trace_begin();
+    struct pollfd pfd = { .fd = ctx->wake_fd, .events = POLLIN };
+    while (!atomic_load(&ctx->stop)) {
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret == 0) {
+            trace_end("sleep", trace_t);
+            return;
+        }
+        if (ret > 0) {
+            uint64_t cnt;
+            if (read(ctx->wake_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+                perror("prefetcher wait");
+            }
+            trace_end("sleep", trace_t);
+            return;
+        }
+        if (ret < 0 && errno != EINTR) {
+            perror("poll");
+            return;
+        }
+    }
+}
 
-    while (true) {
-        pthread_mutex_lock(&ctx->cv_mut);
-        size_t cnt = cached_count_locked(ctx);
-        pthread_mutex_unlock(&ctx->cv_mut);
+// Takes back the buffers of slots the consumer is done with
+static void reclaim_slots(struct image_prefetcher_ctx* ctx, size_t r)
+{
+    const size_t held = (r + ctx->cache_size - 1) % ctx->cache_size;
+    for (; ctx->reclaim != held; ctx->reclaim = (ctx->reclaim + 1) % ctx->cache_size) {
+        struct prefetched_img* img = &ctx->cache[ctx->reclaim];
+        if (img->data && ctx->pool_n < ctx->n_slots) {
+            ctx->pool[ctx->pool_n++] = *img;
+            memset(img, 0, sizeof(*img));
+        } else {
+            cache_entry_free(img);
+        }
+    }
+}
 
-        while (cnt < ctx->prefetch_n) {
-            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+// Moves a finished download to the ring. Only for complete images: a slot is never spent on a failure.
+static void publish(struct image_prefetcher_ctx* ctx, struct dl_slot* dl)
+{
+    uint64_t trace_t = trace_begin();
+    // Only this thread writes cache_w, no need for ordering on our own index
+    size_t w = atomic_load_explicit(&ctx->cache_w, memory_order_relaxed);
+    size_t next_w = (w + 1) % ctx->cache_size;
+    size_t r = atomic_load_explicit(&ctx->cache_r, memory_order_acquire);
+    if (next_w == r) {
+        // Buffer full, drop this image. Its buffer is reused for the next one.
+        return;
+    }
 
-            size_t img_sz = 0;
-            unsigned char* img_data = ctx->downloader_impl(ctx->downloader_impl_usr, &img_sz);
+    // Slot w is not visible to the consumer, and was reclaimed already
+    reclaim_slots(ctx, r);
+    ctx->cache[w] = dl->img;
+    clock_gettime(CLOCK_MONOTONIC, &ctx->cache_ready[w]);
+    memset(&dl->img, 0, sizeof(dl->img));
+    // Publish the slot: the consumer's acquire load of cache_w sees the data
+    atomic_store_explicit(&ctx->cache_w, next_w, memory_order_release);
+    if (ctx->cfg.on_image_ready) {
+        ctx->cfg.on_image_ready(ctx->downloader_impl_usr);
+    }
+    trace_end("enqueue", trace_t);
+}
 
-            pthread_mutex_lock(&ctx->cv_mut);
+static double ms_since(const struct timespec* t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
 
-            size_t next_w = (ctx->cache_w + 1) % ctx->cache_size;
-            if (next_w == ctx->cache_r) {
-                // Buffer full, drop this image
-                pthread_mutex_unlock(&ctx->cv_mut);
-                free(img_data);
-                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-                break;
-            }
+// A download that takes longer than this is unusually slow
+static double slow_download_ms(struct image_prefetcher_ctx* ctx)
+{
+    return ctx->dl_ms_avg + 2 * ctx->dl_ms_dev;
+}
 
-            cache_entry_free(&ctx->cache[ctx->cache_w]);
-            ctx->cache[ctx->cache_w].data = img_data;
-            ctx->cache[ctx->cache_w].sz = img_sz;
-            ctx->cache_w = next_w;
-            cnt = cached_count_locked(ctx);
+// Holds off new downloads for a while, longer after each failure in a row, so a server that's down
+// or overloaded isn't hammered
+static void download_failed(struct image_prefetcher_ctx* ctx)
+{
+    if (atomic_load(&ctx->stop)) {
+        return;
+    }
+    metrics_inc(METRIC_DOWNLOAD_FAILURES, 1);
 
-            pthread_mutex_unlock(&ctx->cv_mut);
+    unsigned retry_ms = ctx->cfg.retry_min_ms;
+    for (unsigned i = 0; i < ctx->failures && retry_ms < ctx->cfg.retry_max_ms; ++i) {
+        retry_ms *= 2;
+    }
+    if (retry_ms > ctx->cfg.retry_max_ms) retry_ms = ctx->cfg.retry_max_ms;
+    ctx->failures++;
+
+    clock_gettime(CLOCK_MONOTONIC, &ctx->retry_at);
+    ctx->retry_at.tv_sec += retry_ms / 1000;
+    ctx->retry_at.tv_nsec += (retry_ms % 1000) * 1000000L;
+    if (ctx->retry_at.tv_nsec >= 1000000000L) {
+        ctx->retry_at.tv_sec++;
+        ctx->retry_at.tv_nsec -= 1000000000L;
+    }
+    printf("Download failed (%u in a row), next one in %u ms\n", ctx->failures, retry_ms);
+}
+
+// Time left before downloads can start again, 0 if they can start now
+static int retry_wait_ms(struct image_prefetcher_ctx* ctx)
+{
+    if (ctx->failures == 0) {
+        return 0;
+    }
+    const double left = -ms_since(&ctx->retry_at);
+    return left > 0 ? (int)left + 1 : 0;
+}
+
+/**
+ * Picks how many images to keep ahead, from moving averages of download time
+ * and size. After the consumer takes an image, the next one must be ready
+ * within consume_interval_ms: a download that's as slow as usual plus some
+ * jitter must end before the cached images run out, so we need that many
+ * intervals' worth of images. The depth is capped so that cached and in
+ * flight images fit in max_mem_bytes.
+ */
+static void update_depth(struct image_prefetcher_ctx* ctx, double dl_ms, size_t sz)
+{
+    if (!ctx->have_samples) {
+        ctx->have_samples = true;
+        ctx->dl_ms_avg = dl_ms;
+        ctx->dl_ms_dev = dl_ms / 2;
+        ctx->img_sz_avg = sz;
+    } else {
+        // Same estimator as TCP's RTT: mean, and mean deviation from it
+        double err = dl_ms - ctx->dl_ms_avg;
+        ctx->dl_ms_avg += EWMA_ALPHA * err;
+        ctx->dl_ms_dev += EWMA_ALPHA * ((err < 0 ? -err : err) - ctx->dl_ms_dev);
+        ctx->img_sz_avg += EWMA_ALPHA * ((double)sz - ctx->img_sz_avg);
+    }
+
+    const double slow_ms = slow_download_ms(ctx);
+    const double interval_ms = ctx->cfg.consume_interval_ms > 0 ? ctx->cfg.consume_interval_ms : 1;
+    size_t depth = (size_t)(slow_ms / interval_ms);
+    if (depth * interval_ms < slow_ms) depth++;
+
+    if (ctx->cfg.max_mem_bytes > 0 && ctx->img_sz_avg > 0) {
+        // Besides the cache: the image the consumer holds, and the pool
+        size_t fit = (size_t)(ctx->cfg.max_mem_bytes / ctx->img_sz_avg);
+        size_t overhead = 1 + ctx->cfg.max_parallel;
+        fit = fit > overhead ? fit - overhead : 0;
+        if (depth > fit) depth = fit;
+    }
 
-            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    if (depth < ctx->cfg.min_n) depth = ctx->cfg.min_n;
+    if (depth > ctx->cfg.max_n) depth = ctx->cfg.max_n;
+
+    size_t old = atomic_load_explicit(&ctx->depth, memory_order_relaxed);
+    if (depth != old) {
+        printf("Prefetch depth %zu -> %zu: downloads take %.0f ms (+-%.0f), %.0f KB per image\n",
+               old, depth, ctx->dl_ms_avg, ctx->dl_ms_dev, ctx->img_sz_avg / 1024);
+        atomic_store_explicit(&ctx->depth, depth, memory_order_relaxed);
+    }
+}
+
+static bool start_slot(struct image_prefetcher_ctx* ctx, struct dl_slot* dl)
+{
+    if (!dl->img.data && ctx->pool_n > 0) {
+        dl->img = ctx->pool[--ctx->pool_n];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &dl->started);
+    dl->trace_started = trace_begin();
+    dl->hedged = false;
+    if (!ctx->download_start(ctx->downloader_impl_usr, &dl->img, &ctx->stop)) {
+        return false;
+    }
+    dl->in_flight = true;
+    ctx->in_flight++;
+    return true;
+}
+
+/**
+ * Starts a second download when the consumer has nothing to show and waits on
+ * one that's unusually slow, eg stuck on a bad connection that hasn't timed
+ * out yet. The server hands out a new image for each request, so nothing is
+ * wasted: if both end, both are shown.
+ */
+static void maybe_hedge(struct image_prefetcher_ctx* ctx, size_t cached)
+{
+    struct dl_slot* hedge = &ctx->dl_slots[ctx->cfg.max_parallel];
+    if (!ctx->cfg.hedge || hedge->in_flight || cached > 0 || !ctx->have_samples) {
+        return;
+    }
+
+    double hedge_ms = slow_download_ms(ctx);
+    if (hedge_ms < HEDGE_MIN_MS) hedge_ms = HEDGE_MIN_MS;
+    for (size_t i = 0; i < ctx->cfg.max_parallel; ++i) {
+        struct dl_slot* dl = &ctx->dl_slots[i];
+        if (!dl->in_flight || dl->hedged) {
+            continue;
+        }
+        const double dl_ms = ms_since(&dl->started);
+        if (dl_ms < hedge_ms) {
+            continue;
+        }
+        // One hedge per slow download, even if the hedge fails
+        dl->hedged = true;
+        if (start_slot(ctx, hedge)) {
+            printf("Download slow (%.0f ms, usually %.0f ms), starting another one\n", dl_ms, ctx->dl_ms_avg);
+            metrics_inc(METRIC_HEDGED_DOWNLOADS, 1);
+        }
+        return;
+    }
+}
+
+// Starts downloads until cached + in flight images fill the cache
+static void start_downloads(struct image_prefetcher_ctx* ctx)
+{
+    size_t r = atomic_load_explicit(&ctx->cache_r, memory_order_acquire);
+    size_t w = atomic_load_explicit(&ctx->cache_w, memory_order_relaxed);
+    size_t cached = cached_count(ctx, r, w);
+    size_t depth = atomic_load_explicit(&ctx->depth, memory_order_relaxed);
+    reclaim_slots(ctx, r);
+    if (retry_wait_ms(ctx) > 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < ctx->cfg.max_parallel; ++i) {
+        if (cached + ctx->in_flight >= depth) {
+            break;
+        }
+
+        struct dl_slot* dl = &ctx->dl_slots[i];
+        if (dl->in_flight) {
+            continue;
         }
+        if (!start_slot(ctx, dl)) {
+            // Same as a failed download
+            download_failed(ctx);
+            return;
+        }
+    }
+    maybe_hedge(ctx, cached);
+}
+
+static void wait_download(struct image_prefetcher_ctx* ctx, bool publish_done)
+{
+    uint64_t trace_t = trace_begin();
+    struct prefetched_img* img = ctx->download_wait(ctx->downloader_impl_usr, DOWNLOAD_POLL_MS);
+    trace_end("wait download", trace_t);
+    if (!img) {
+        return;
+    }
 
-        pthread_mutex_lock(&ctx->cv_mut);
-        pthread_cond_wait(&ctx->condvar, &ctx->cv_mut);
-        pthread_mutex_unlock(&ctx->cv_mut);
+    // img is the first member of its dl_slot
+    struct dl_slot* dl = (struct dl_slot*)img;
+    trace_end_async("download", dl->trace_started, (unsigned)(dl - ctx->dl_slots) + 1);
+    dl->in_flight = false;
+    ctx->in_flight--;
+    if (!publish_done) {
+        return;
+    }
+
+    if (img->sz == 0) {
+        // The buffer stays in the download slot, for the next try
+        download_failed(ctx);
+        return;
+    }
+
+    ctx->failures = 0;
+    metrics_observe_since(METRIC_DOWNLOAD, &dl->started);
+    metrics_inc(METRIC_DOWNLOADS, 1);
+    metrics_inc(METRIC_DOWNLOAD_BYTES, img->sz);
+    update_depth(ctx, ms_since(&dl->started), img->sz);
+    publish(ctx, dl);
+}
+
+void* image_prefetcher_thread(void* usr)
+{
+    struct image_prefetcher_ctx* ctx = usr;
+    trace_thread_name("prefetcher");
+
+    while (!atomic_load(&ctx->stop)) {
+        uint64_t trace_t = trace_begin();
+        start_downloads(ctx);
+        trace_end("start downloads", trace_t);
+        if (ctx->in_flight == 0) {
+            // Cache is full, or backing off after a failure
+            const int retry_ms = retry_wait_ms(ctx);
+            wait_for_wake(ctx, retry_ms > 0 ? retry_ms : -1);
+            continue;
+        }
+        wait_download(ctx, true);
+    }
+
+    // Downloads see the stop flag too, so this doesn't take long
+    while (ctx->in_flight > 0) {
+        wait_download(ctx, false);
     }
 
     return NULL;
 }
 
+size_t image_prefetcher_get_depth(struct image_prefetcher_ctx* ctx)
+{
+    return atomic_load_explicit(&ctx->depth, memory_order_relaxed);
+}
+
 size_t image_prefetcher_get_cached(struct image_prefetcher_ctx* ctx)
 {
-    pthread_mutex_lock(&ctx->cv_mut);
-    size_t cnt = cached_count_locked(ctx);
-    pthread_mutex_unlock(&ctx->cv_mut);
-    return cnt;
+    size_t r = atomic_load_explicit(&ctx->cache_r, memory_order_acquire);
+    size_t w = atomic_load_explicit(&ctx->cache_w, memory_order_acquire);
+    return cached_count(ctx, r, w);
 }
 
 struct prefetched_img* image_prefetcher_jump_next(struct image_prefetcher_ctx* ctx)
 {
-    pthread_mutex_lock(&ctx->cv_mut);
-
-    if (ctx->cache_r == ctx->cache_w) {
+    size_t r = atomic_load_explicit(&ctx->cache_r, memory_order_relaxed);
+    if (r == atomic_load_explicit(&ctx->cache_w, memory_order_acquire)) {
         // Empty
-        pthread_mutex_unlock(&ctx->cv_mut);
         return NULL;
     }
 
-    struct prefetched_img* ret = &ctx->cache[ctx->cache_r];
-    ctx->cache_r = (ctx->cache_r + 1) % ctx->cache_size;
-
-    pthread_mutex_unlock(&ctx->cv_mut);
+    struct prefetched_img* ret = &ctx->cache[r];
+    metrics_observe_since(METRIC_QUEUE_WAIT, &ctx->cache_ready[r]);
+    // Hand the slot before r back to the producer, and reserve r for the caller
+    atomic_store_explicit(&ctx->cache_r, (r + 1) % ctx->cache_size, memory_order_release);
 
     // Wake prefetcher to refill
-    pthread_cond_signal(&ctx->condvar);
+    wake_producer(ctx);
 
     return ret;
 }
-
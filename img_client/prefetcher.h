@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 
@@ -7,37 +8,86 @@ struct image_prefetcher_ctx;
 
 /**
  * An image buffer downloaded by the prefetcher.
- * Owned by the prefetcher — do not free.
+ * Owned by the prefetcher — do not free. Accounted as MEM_PREFETCH, see
+ * mem_budget.h; download callbacks should account for buffers they take.
  */
 struct prefetched_img {
     unsigned char* data;
-    size_t sz;
+    size_t sz;   // Image size, 0 if the download failed. Failed downloads never reach the cache.
+    size_t cap;  // Allocated size of data
 };
 
 /**
- * Callback to fetch an image in-memory. Caller takes ownership of the buffer.
- * Should set *out_sz and return a malloc'd buffer, or NULL on failure.
+ * Callbacks to fetch images in-memory, possibly several at a time.
+ *
+ * download_start_cb starts downloading an image into img. img holds a buffer
+ * recycled from an image the consumer is done with (or NULL/0 at first): it
+ * should be reused if the image fits, and may be realloc'd (and img->cap
+ * updated) if it doesn't. Returns false if the download can't be started.
+ * The prefetcher sets *cancel when shutting down: transfers should be aborted
+ * as soon as possible.
+ *
+ * download_wait_cb waits up to timeout_ms for a started download to end, and
+ * returns the img it was started with, with data/cap updated and sz set (0 if
+ * the download failed). Returns NULL if nothing ended. Buffers stay owned by
+ * the prefetcher either way.
  */
-typedef unsigned char* (*downloader_cb)(void* usr, size_t* out_sz);
+typedef bool (*download_start_cb)(void* usr, struct prefetched_img* img, const atomic_bool* cancel);
+typedef struct prefetched_img* (*download_wait_cb)(void* usr, int timeout_ms);
+
+// Called from the prefetcher thread when an image is added to the cache
+typedef void (*image_ready_cb)(void* usr);
+
+struct image_prefetcher_cfg {
+    // Number of images downloaded ahead adapts between min_n and max_n,
+    // starting from initial_n
+    size_t min_n;
+    size_t max_n;
+    size_t initial_n;
+    size_t max_parallel;
+    // How often the consumer takes an image. The prefetcher keeps enough images
+    // ahead that the next one is ready in time, given how long downloads take.
+    unsigned consume_interval_ms;
+    // Fewer images are kept ahead if they wouldn't fit in this. 0 for no limit.
+    size_t max_mem_bytes;
+    // After a failed download, no new one starts for retry_min_ms, doubling
+    // with each failure in a row up to retry_max_ms.
+    unsigned retry_min_ms;
+    unsigned retry_max_ms;
+    // If nothing is cached and a download is much slower than usual, start
+    // another one next to it, in an extra slot: download_start_cb must take
+    // up to max_parallel + 1 downloads. Whichever ends first is shown first.
+    bool hedge;
+    // Optional, called with the downloader's usr. Lets the consumer sleep
+    // until there is an image, instead of polling.
+    image_ready_cb on_image_ready;
+};
 
 /**
- * Creates a prefetcher. Will prefetch up to prefetch_n images ahead
- * using the provided callback in a background thread.
+ * Creates a prefetcher, which downloads images ahead using the provided
+ * callbacks in a background thread, with up to max_parallel downloads in
+ * flight.
  */
-struct image_prefetcher_ctx* image_prefetcher_init(downloader_cb cb,
+struct image_prefetcher_ctx* image_prefetcher_init(download_start_cb start_cb,
+                                                   download_wait_cb wait_cb,
                                                    void* downloader_impl_usr,
-                                                   size_t prefetch_n);
+                                                   const struct image_prefetcher_cfg* cfg);
 
 void image_prefetcher_free(struct image_prefetcher_ctx* ctx);
 
 /**
- * Returns the number of currently cached and available images.
+ * Returns the number of currently cached and available images. Never blocks.
  */
 size_t image_prefetcher_get_cached(struct image_prefetcher_ctx* ctx);
 
 /**
- * Return the next image in the cache, or NULL if none available.
+ * Returns how many images the prefetcher is currently trying to keep ahead.
+ */
+size_t image_prefetcher_get_depth(struct image_prefetcher_ctx* ctx);
+
+/**
+ * Return the next image in the cache, or NULL if none available. Never blocks.
  * The returned pointer is owned by the prefetcher — valid until the
- * next call to jump_next.
+ * next call to jump_next. Must always be called from the same thread.
  */
 struct prefetched_img* image_prefetcher_jump_next(struct image_prefetcher_ctx* ctx);
@@ -0,0 +1,350 @@
+#include "jpeg_decode.h"
+#include "gray_conv.h"
+#include "mem_budget.h"
+
+#include <jerror.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+const char* jpeg_decode_profile_name(enum jpeg_decode_profile p) {
+    switch (p) {
+    case JPEG_DECODE_FAST: return "fast";
+    case JPEG_DECODE_QUALITY: return "quality";
+    }
+    return "unknown";
+}
+
+static void error_exit_longjmp(j_common_ptr cinfo) {
+    struct jpeg_decode_err* err = (struct jpeg_decode_err*)cinfo->err;
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(err->jmp, 1);
+}
+
+struct jpeg_error_mgr* jpeg_decode_err_init(struct jpeg_decode_err* err) {
+    jpeg_std_error(&err->pub);
+    err->pub.error_exit = error_exit_longjmp;
+    return &err->pub;
+}
+
+void jpeg_decoder_init(struct jpeg_decoder* d, enum jpeg_decode_profile p) {
+    memset(d, 0, sizeof(*d));
+    d->profile = p;
+}
+
+void jpeg_decoder_free(struct jpeg_decoder* d) {
+    mem_budget_release(MEM_DECODER, d->buf_sz + d->lib_mem);
+    d->lib_mem = 0;
+    free(d->buf);
+    d->buf = NULL;
+    d->buf_sz = 0;
+}
+
+void jpeg_decoder_setup(struct jpeg_decoder* d, struct jpeg_decompress_struct* cinfo,
+                        int screen_w, int screen_h) {
+    unsigned int denoms[] = {1, 2, 4, 8};
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = 1;
+    for (int i = 0; i < 4; i++) {
+        if ((int)(cinfo->image_width / denoms[i]) >= screen_w &&
+            (int)(cinfo->image_height / denoms[i]) >= screen_h) {
+            cinfo->scale_denom = denoms[i];
+        }
+    }
+
+    if (d->profile == JPEG_DECODE_FAST) {
+        // libjpeg can only produce gray from these; anything else (eg CMYK) stays
+        // in its default colorspace and goes through the RGB path
+        if (cinfo->jpeg_color_space == JCS_YCbCr ||
+            cinfo->jpeg_color_space == JCS_GRAYSCALE ||
+            cinfo->jpeg_color_space == JCS_RGB) {
+            cinfo->out_color_space = JCS_GRAYSCALE;
+        }
+        cinfo->dct_method = JDCT_IFAST;
+        cinfo->do_fancy_upsampling = FALSE;
+        cinfo->do_block_smoothing = FALSE;
+    } else {
+        cinfo->dct_method = JDCT_ISLOW;
+        cinfo->do_fancy_upsampling = TRUE;
+        cinfo->do_block_smoothing = TRUE;
+    }
+}
+
+// What libjpeg will allocate for an image, roughly. Progressive images need
+// coefficients for the whole image; others only a few rows of iMCUs.
+static size_t estimate_lib_mem(const struct jpeg_decompress_struct* cinfo) {
+    size_t sz = 0;
+    if (cinfo->progressive_mode || cinfo->buffered_image) {
+        for (int i = 0; i < cinfo->num_components; i++) {
+            const jpeg_component_info* comp = &cinfo->comp_info[i];
+            sz += (size_t)comp->width_in_blocks * comp->height_in_blocks * sizeof(JBLOCK);
+        }
+    } else {
+        sz = (size_t)cinfo->image_width * cinfo->num_components * DCTSIZE * cinfo->max_v_samp_factor * 2;
+    }
+    return sz;
+}
+
+// Accounts for growing a buffer from old_sz to new_sz bytes
+static bool reserve_growth(size_t old_sz, size_t new_sz, const struct jpeg_decompress_struct* cinfo) {
+    if (!mem_budget_reserve(MEM_DECODER, new_sz - old_sz)) {
+        fprintf(stderr, "Can't decode %ux%u image, doesn't fit in memory budget\n",
+                cinfo->image_width, cinfo->image_height);
+        return false;
+    }
+    return true;
+}
+
+bool jpeg_decoder_start(struct jpeg_decoder* d, struct jpeg_decompress_struct* cinfo) {
+    // From the previous image, if it didn't finish (eg a decode error)
+    mem_budget_release(MEM_DECODER, d->lib_mem);
+    d->lib_mem = estimate_lib_mem(cinfo);
+    if (!reserve_growth(0, d->lib_mem, cinfo)) {
+        d->lib_mem = 0;
+        return false;
+    }
+
+    // libjpeg enforces this on its big allocations, so a bad estimate still can't run away
+    size_t avail = mem_budget_available();
+    if (avail != SIZE_MAX) {
+        size_t max_mem = d->lib_mem + avail;
+        cinfo->mem->max_memory_to_use = max_mem > LONG_MAX ? LONG_MAX : (long)max_mem;
+    }
+
+    jpeg_start_decompress(cinfo);
+
+    // Read in multiples of what libjpeg can produce per call without buffering
+    int unit = cinfo->rec_outbuf_height > 0 ? cinfo->rec_outbuf_height : 1;
+    d->batch_rows = unit > JPEG_DECODE_MAX_BATCH ? unit : JPEG_DECODE_MAX_BATCH - JPEG_DECODE_MAX_BATCH % unit;
+    if (d->batch_rows > JPEG_DECODE_MAX_BATCH) {
+        d->batch_rows = JPEG_DECODE_MAX_BATCH;
+    }
+
+    d->end_row = cinfo->output_height;
+    d->row_stride = (size_t)cinfo->output_width * cinfo->output_components;
+    size_t need = d->row_stride * d->batch_rows;
+    if (need > d->buf_sz) {
+        if (!reserve_growth(d->buf_sz, need, cinfo)) {
+            return false;
+        }
+        unsigned char* buf = realloc(d->buf, need);
+        if (!buf) {
+            fprintf(stderr, "bad alloc, can't decode %ux%u image\n",
+                    cinfo->output_width, cinfo->output_height);
+            mem_budget_release(MEM_DECODER, need - d->buf_sz);
+            return false;
+        }
+        d->buf = buf;
+        d->buf_sz = need;
+    }
+
+    for (int i = 0; i < d->batch_rows; i++) {
+        d->rows[i] = d->buf + i * d->row_stride;
+    }
+    return true;
+}
+
+void jpeg_decoder_set_window(struct jpeg_decoder* d, struct jpeg_decompress_struct* cinfo,
+                             int x, int y, int w, int h, int* x_in_row) {
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > (int)cinfo->output_width) w = (int)cinfo->output_width - x;
+    if (y + h > (int)cinfo->output_height) h = (int)cinfo->output_height - y;
+
+    *x_in_row = x;
+    if (w <= 0 || h <= 0) {
+        d->end_row = cinfo->output_scanline;
+        return;
+    }
+
+    if (x > 0 || w < (int)cinfo->output_width) {
+        // Adjusts xoffset down to an iMCU boundary, and width to cover the window.
+        // output_width becomes the cropped width.
+        JDIMENSION xoff = x, width = w;
+        jpeg_crop_scanline(cinfo, &xoff, &width);
+        *x_in_row = x - (int)xoff;
+    }
+
+    if (y > (int)cinfo->output_scanline) {
+        jpeg_skip_scanlines(cinfo, y - cinfo->output_scanline);
+    }
+    d->end_row = y + h;
+}
+
+int jpeg_decoder_read(struct jpeg_decoder* d, struct jpeg_decompress_struct* cinfo) {
+    if (cinfo->output_scanline >= d->end_row) {
+        return 0;
+    }
+    unsigned n = d->end_row - cinfo->output_scanline;
+    if (n > (unsigned)d->batch_rows) n = d->batch_rows;
+    return (int)jpeg_read_scanlines(cinfo, d->rows, n);
+}
+
+int jpeg_decoder_read_into(struct jpeg_decoder* d, struct jpeg_decompress_struct* cinfo,
+                           unsigned char* dst, size_t stride) {
+    if (cinfo->output_scanline >= d->end_row) {
+        return 0;
+    }
+    unsigned n = d->end_row - cinfo->output_scanline;
+    if (n > (unsigned)d->batch_rows) n = d->batch_rows;
+    JSAMPROW rows[JPEG_DECODE_MAX_BATCH];
+    for (unsigned i = 0; i < n; i++) {
+        rows[i] = dst + i * stride;
+    }
+    return (int)jpeg_read_scanlines(cinfo, rows, n);
+}
+
+void jpeg_decoder_finish(struct jpeg_decoder* d, struct jpeg_decompress_struct* cinfo) {
+    mem_budget_release(MEM_DECODER, d->lib_mem);
+    d->lib_mem = 0;
+    if (cinfo->output_scanline < cinfo->output_height) {
+        jpeg_abort_decompress(cinfo);
+    } else {
+        jpeg_finish_decompress(cinfo);
+    }
+}
+
+struct pull_src {
+    struct jpeg_source_mgr pub;
+    jpeg_decode_pull_cb next_chunk;
+    void* usr;
+};
+
+static void pull_init_source(j_decompress_ptr cinfo) {
+    (void)cinfo;
+}
+
+static boolean pull_fill_input_buffer(j_decompress_ptr cinfo) {
+    struct pull_src* src = (struct pull_src*)cinfo->src;
+    const unsigned char* chunk = NULL;
+    size_t sz = src->next_chunk(src->usr, &chunk);
+    if (sz == 0) {
+        // Same as libjpeg's own sources: warn, and end the image with a fake EOI
+        static const JOCTET fake_eoi[2] = {0xFF, JPEG_EOI};
+        WARNMS(cinfo, JWRN_JPEG_EOF);
+        chunk = fake_eoi;
+        sz = sizeof(fake_eoi);
+    }
+    src->pub.next_input_byte = chunk;
+    src->pub.bytes_in_buffer = sz;
+    return TRUE;
+}
+
+static void pull_skip_input_data(j_decompress_ptr cinfo, long num_bytes) {
+    struct jpeg_source_mgr* src = cinfo->src;
+    while (num_bytes > (long)src->bytes_in_buffer) {
+        num_bytes -= (long)src->bytes_in_buffer;
+        pull_fill_input_buffer(cinfo);
+    }
+    if (num_bytes > 0) {
+        src->next_input_byte += num_bytes;
+        src->bytes_in_buffer -= num_bytes;
+    }
+}
+
+static void pull_term_source(j_decompress_ptr cinfo) {
+    (void)cinfo;
+}
+
+void jpeg_decode_pull_src(struct jpeg_decompress_struct* cinfo,
+                          jpeg_decode_pull_cb next_chunk, void* usr) {
+    struct pull_src* src = (*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT,
+                                                      sizeof(struct pull_src));
+    src->pub.init_source = pull_init_source;
+    src->pub.fill_input_buffer = pull_fill_input_buffer;
+    src->pub.skip_input_data = pull_skip_input_data;
+    src->pub.resync_to_restart = jpeg_resync_to_restart;
+    src->pub.term_source = pull_term_source;
+    src->pub.next_input_byte = NULL;
+    src->pub.bytes_in_buffer = 0;
+    src->next_chunk = next_chunk;
+    src->usr = usr;
+    cinfo->src = &src->pub;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void jpeg_decode_bench(const char* path, int screen_w, int screen_h, const struct gray_conv* conv) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    long sz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char* data = malloc(sz > 0 ? sz : 1);
+    if (!data || fread(data, 1, sz, f) != (size_t)sz) {
+        fprintf(stderr, "Can't read %s\n", path);
+        free(data);
+        fclose(f);
+        return;
+    }
+    fclose(f);
+
+    unsigned char* gray = malloc(screen_w);
+    if (!gray) {
+        free(data);
+        return;
+    }
+
+    const int reps = 5;
+    const enum jpeg_decode_profile profiles[] = {JPEG_DECODE_QUALITY, JPEG_DECODE_FAST};
+    for (size_t p = 0; p < sizeof(profiles) / sizeof(profiles[0]); p++) {
+        struct jpeg_decoder d;
+        jpeg_decoder_init(&d, profiles[p]);
+        double best_dec = 1e12, best_conv = 1e12;
+        unsigned out_w = 0, out_h = 0;
+        for (int r = 0; r < reps; r++) {
+            struct jpeg_decompress_struct cinfo;
+            struct jpeg_error_mgr jerr;
+            cinfo.err = jpeg_std_error(&jerr);
+            jpeg_create_decompress(&cinfo);
+
+            double conv_ms = 0;
+            double t0 = now_ms();
+            jpeg_mem_src(&cinfo, data, sz);
+            jpeg_read_header(&cinfo, TRUE);
+            jpeg_decoder_setup(&d, &cinfo, screen_w, screen_h);
+            if (!jpeg_decoder_start(&d, &cinfo)) {
+                jpeg_destroy_decompress(&cinfo);
+                break;
+            }
+            out_w = cinfo.output_width;
+            out_h = cinfo.output_height;
+            int off_x = (int)out_w > screen_w ? ((int)out_w - screen_w) / 2 : 0;
+            int off_y = (int)out_h > screen_h ? ((int)out_h - screen_h) / 2 : 0;
+            int x_in_row;
+            jpeg_decoder_set_window(&d, &cinfo, off_x, off_y, screen_w, screen_h, &x_in_row);
+            size_t w = out_w - off_x < (unsigned)screen_w ? out_w - off_x : (unsigned)screen_w;
+
+            int n;
+            while ((n = jpeg_decoder_read(&d, &cinfo)) > 0) {
+                double c0 = now_ms();
+                for (int i = 0; i < n; i++) {
+                    gray_conv_row(conv, d.rows[i] + x_in_row * cinfo.output_components,
+                                  cinfo.output_components, gray, w);
+                }
+                conv_ms += now_ms() - c0;
+            }
+            jpeg_decoder_finish(&d, &cinfo);
+            double total = now_ms() - t0;
+            jpeg_destroy_decompress(&cinfo);
+
+            if (total - conv_ms < best_dec) best_dec = total - conv_ms;
+            if (conv_ms < best_conv) best_conv = conv_ms;
+        }
+        printf("decode %-7s %ux%u: %7.2f ms decode, %6.2f ms convert (best of %d)\n",
+               jpeg_decode_profile_name(profiles[p]), out_w, out_h, best_dec, best_conv, reps);
+        jpeg_decoder_free(&d);
+    }
+
+    free(gray);
+    free(data);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <jpeglib.h>
+
+struct gray_conv;
+
+// Max rows read per jpeg_read_scanlines call
+#define JPEG_DECODE_MAX_BATCH 16
+
+enum jpeg_decode_profile {
+    // Gray output straight from libjpeg, fast integer IDCT, no fancy upsampling
+    // or block smoothing. Good enough for a CRT.
+    JPEG_DECODE_FAST,
+    // libjpeg defaults: RGB output, accurate IDCT, fancy upsampling
+    JPEG_DECODE_QUALITY,
+};
+
+/**
+ * Decoder setup shared by all JPEG render paths. Owns a row buffer that is
+ * reused between images, so steady state decoding doesn't allocate.
+ */
+struct jpeg_decoder {
+    enum jpeg_decode_profile profile;
+    unsigned char* buf;
+    size_t buf_sz;
+    size_t row_stride;
+    int batch_rows;
+    // Reads stop at this output row, see jpeg_decoder_set_window
+    unsigned end_row;
+    JSAMPROW rows[JPEG_DECODE_MAX_BATCH];
+    // Estimate of libjpeg's working memory for the current image
+    size_t lib_mem;
+};
+
+/**
+ * libjpeg error handler that longjmps back to the caller instead of exiting
+ * the process, so a corrupt or truncated image can't take picrt down. Call
+ * setjmp(err.jmp) before using the decompressor.
+ */
+struct jpeg_decode_err {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+};
+
+struct jpeg_error_mgr* jpeg_decode_err_init(struct jpeg_decode_err* err);
+
+const char* jpeg_decode_profile_name(enum jpeg_decode_profile p);
+
+void jpeg_decoder_init(struct jpeg_decoder* d, enum jpeg_decode_profile p);
+void jpeg_decoder_free(struct jpeg_decoder* d);
+
+/**
+ * Call after jpeg_read_header. Picks the largest DCT downscale that still
+ * covers the screen and applies the decode profile.
+ */
+void jpeg_decoder_setup(struct jpeg_decoder* d, struct jpeg_decompress_struct* cinfo,
+                        int screen_w, int screen_h);
+
+/**
+ * Starts decompression and sizes the row buffer for the output image. The row
+ * buffers and an estimate of libjpeg's working memory are accounted as
+ * MEM_DECODER, and libjpeg's max_memory_to_use is set from what's left of the
+ * memory budget. Returns false on bad alloc, or if the image doesn't fit in
+ * the budget.
+ */
+bool jpeg_decoder_start(struct jpeg_decoder* d, struct jpeg_decompress_struct* cinfo);
+
+/**
+ * Call after jpeg_decoder_start to only decode a w*h window at (x, y) of the
+ * output image. Columns are cropped with jpeg_crop_scanline, which can only
+ * start at an iMCU boundary: rows may start a few pixels before x, and
+ * *x_in_row is set to where column x lands in d->rows. Rows above the window
+ * are skipped with jpeg_skip_scanlines, and reads stop after its last row.
+ * The window is clipped to the image.
+ */
+void jpeg_decoder_set_window(struct jpeg_decoder* d, struct jpeg_decompress_struct* cinfo,
+                             int x, int y, int w, int h, int* x_in_row);
+
+/**
+ * Reads the next batch of scanlines into d->rows. Returns the number of rows
+ * read, 0 once the image (or window) is done.
+ */
+int jpeg_decoder_read(struct jpeg_decoder* d, struct jpeg_decompress_struct* cinfo);
+
+/**
+ * Like jpeg_decoder_read, but decodes straight into the caller's memory: row i
+ * of the batch goes to dst + i * stride, and must have room for output_width *
+ * output_components bytes.
+ */
+int jpeg_decoder_read_into(struct jpeg_decoder* d, struct jpeg_decompress_struct* cinfo,
+                           unsigned char* dst, size_t stride);
+
+/**
+ * Ends decompression. If reading stopped early, because of a window or
+ * because the caller gave up, the rest of the image is never decoded.
+ */
+void jpeg_decoder_finish(struct jpeg_decoder* d, struct jpeg_decompress_struct* cinfo);
+
+/**
+ * Data source that pulls input on demand, to decode while downloading.
+ * next_chunk should block until more data is available, set *chunk and return
+ * its size, or return 0 once there is no more data. Chunks must stay valid
+ * until decoding ends. A truncated stream is decoded as far as it goes.
+ */
+typedef size_t (*jpeg_decode_pull_cb)(void* usr, const unsigned char** chunk);
+void jpeg_decode_pull_src(struct jpeg_decompress_struct* cinfo,
+                          jpeg_decode_pull_cb next_chunk, void* usr);
+
+// Decodes a JPEG file with each profile and prints the time per image
+void jpeg_decode_bench(const char* path, int screen_w, int screen_h,
+                       const struct gray_conv* conv);
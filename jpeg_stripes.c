@@ -0,0 +1,389 @@
+#include "jpeg_stripes.h"
+#include "gray_conv.h"
+#include "mem_budget.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct stripe {
+    int mcu_row0;
+    int mcu_row1;
+    bool failed;
+};
+
+struct jpeg_stripes {
+    struct worker_pool* pool;
+    enum jpeg_decode_profile profile;
+    const struct gray_conv* conv;
+    // One per thread; stripe i is decoded with decs[i]
+    struct jpeg_decoder* decs;
+    struct stripe* stripes;
+    int n_decs;
+};
+
+// Where things are in a JPEG file, as far as splitting it goes
+struct jpeg_layout {
+    size_t height_at;  // SOF's image height field
+    size_t scan_at;    // First byte of entropy coded data
+    size_t scan_end;   // EOI
+    int image_h;
+    int mcu_h;
+    int mcus_per_row;
+    int mcu_rows;
+    unsigned restart_interval;  // In MCUs
+    // Where each restart interval's data starts: the first one at scan_at, the rest after an RST
+    size_t* intervals;
+    int n_intervals;
+};
+
+struct stripe_job {
+    struct jpeg_stripes* js;
+    const unsigned char* data;
+    const struct jpeg_layout* layout;
+    struct stripe* stripes;
+    unsigned scale_denom;
+    JDIMENSION out_w;
+    unsigned char* dst;
+    int dst_w;
+    // Window of the output image that lands in dst, as in render_jpeg_decompress
+    int off_x;
+    int off_y;
+    int visible_w;
+    int visible_h;
+};
+
+struct jpeg_stripes* jpeg_stripes_new(struct worker_pool* pool, enum jpeg_decode_profile profile,
+                                      const struct gray_conv* conv) {
+    struct jpeg_stripes* js = calloc(1, sizeof(struct jpeg_stripes));
+    if (!js) {
+        fprintf(stderr, "bad alloc\n");
+        return NULL;
+    }
+    js->pool = pool;
+    js->profile = profile;
+    js->conv = conv;
+    js->n_decs = worker_pool_threads(pool);
+    js->decs = calloc(js->n_decs, sizeof(struct jpeg_decoder));
+    js->stripes = calloc(js->n_decs, sizeof(struct stripe));
+    if (!js->decs || !js->stripes) {
+        fprintf(stderr, "bad alloc\n");
+        free(js->decs);
+        free(js->stripes);
+        free(js);
+        return NULL;
+    }
+    for (int i = 0; i < js->n_decs; i++) {
+        jpeg_decoder_init(&js->decs[i], profile);
+    }
+    return js;
+}
+
+void jpeg_stripes_free(struct jpeg_stripes* js) {
+    if (!js) {
+        return;
+    }
+    for (int i = 0; i < js->n_decs; i++) {
+        jpeg_decoder_free(&js->decs[i]);
+    }
+    free(js->decs);
+    free(js->stripes);
+    free(js);
+}
+
+static unsigned read_u16(const unsigned char* p) {
+    return (p[0] << 8) | p[1];
+}
+
+// Finds the restart markers of a single scan JPEG. Returns false for anything that can't be split.
+static bool parse_layout(const unsigned char* d, size_t sz, struct jpeg_layout* l) {
+    memset(l, 0, sizeof(*l));
+    if (sz < 4 || d[0] != 0xFF || d[1] != 0xD8) {
+        return false;
+    }
+
+    int image_w = 0, n_comps = 0, h_max = 1, v_max = 1;
+    size_t i = 2;
+    while (!l->scan_at) {
+        if (i + 4 > sz || d[i] != 0xFF) {
+            return false;
+        }
+        const unsigned marker = d[i + 1];
+        if (marker == 0xFF) {
+            // Fill byte
+            i++;
+            continue;
+        }
+        const size_t len = read_u16(d + i + 2);
+        if (len < 2 || i + 2 + len > sz) {
+            return false;
+        }
+        const unsigned char* seg = d + i + 4;
+
+        if (marker == 0xC0 || marker == 0xC1) {
+            if (len < 8) return false;
+            l->height_at = i + 5;
+            l->image_h = read_u16(seg + 1);
+            image_w = read_u16(seg + 3);
+            n_comps = seg[5];
+            if (len < 8 + 3 * (size_t)n_comps) return false;
+            for (int c = 0; c < n_comps; c++) {
+                const int h = seg[6 + 3 * c + 1] >> 4, v = seg[6 + 3 * c + 1] & 0xF;
+                if (h > h_max) h_max = h;
+                if (v > v_max) v_max = v;
+            }
+        } else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xCC) {
+            // Progressive, lossless or arithmetic coded
+            return false;
+        } else if (marker == 0xDD) {
+            if (len < 4) return false;
+            l->restart_interval = read_u16(seg);
+        } else if (marker == 0xDA) {
+            // Images with a scan per component can't be split by rows
+            if (!n_comps || seg[0] != n_comps) return false;
+            l->scan_at = i + 2 + len;
+        }
+        i += 2 + len;
+    }
+    if (!l->height_at || !l->restart_interval || !image_w || !l->image_h) {
+        return false;
+    }
+
+    // Non interleaved scans (one component) have one block per MCU
+    const int mcu_w = n_comps == 1 ? 8 : 8 * h_max;
+    l->mcu_h = n_comps == 1 ? 8 : 8 * v_max;
+    l->mcus_per_row = (image_w + mcu_w - 1) / mcu_w;
+    l->mcu_rows = (l->image_h + l->mcu_h - 1) / l->mcu_h;
+    const size_t mcus = (size_t)l->mcus_per_row * l->mcu_rows;
+    l->n_intervals = (mcus + l->restart_interval - 1) / l->restart_interval;
+    l->intervals = malloc(l->n_intervals * sizeof(size_t));
+    if (!l->intervals) {
+        return false;
+    }
+
+    int found = 0;
+    l->intervals[found++] = l->scan_at;
+    for (i = l->scan_at; i + 1 < sz; i++) {
+        const unsigned char* ff = memchr(d + i, 0xFF, sz - 1 - i);
+        if (!ff) break;
+        i = ff - d;
+        const unsigned char m = d[i + 1];
+        if (m == 0x00 || m == 0xFF) {
+            // Stuffed 0xFF, or fill
+            continue;
+        }
+        if (m >= 0xD0 && m <= 0xD7) {
+            if (found == l->n_intervals) break;
+            l->intervals[found++] = i + 2;
+            i++;
+            continue;
+        }
+        if (m == 0xD9) {
+            l->scan_end = i;
+        }
+        // EOI, or the start of another scan
+        break;
+    }
+    return l->scan_end && found == l->n_intervals;
+}
+
+// Interval that starts at a row of MCUs; only valid for rows at interval boundaries
+static int interval_of_row(const struct jpeg_layout* l, int mcu_row) {
+    return (int)((size_t)mcu_row * l->mcus_per_row / l->restart_interval);
+}
+
+// Restart intervals [k0, k1) of a stripe, and where their data is
+static void stripe_data(const struct jpeg_layout* l, const struct stripe* st,
+                        int* k0, int* k1, size_t* begin, size_t* end) {
+    *k0 = interval_of_row(l, st->mcu_row0);
+    *k1 = st->mcu_row1 < l->mcu_rows ? interval_of_row(l, st->mcu_row1) : l->n_intervals;
+    *begin = l->intervals[*k0];
+    // Data of interval k1 - 1 ends right before the RST that starts k1
+    *end = *k1 < l->n_intervals ? l->intervals[*k1] - 2 : l->scan_end;
+}
+
+// Size of the stripe's JPEG, see stripe_jpeg
+static size_t stripe_jpeg_size(const struct jpeg_layout* l, const struct stripe* st) {
+    int k0, k1;
+    size_t begin, end;
+    stripe_data(l, st, &k0, &k1, &begin, &end);
+    return l->scan_at + (end - begin) + 2;
+}
+
+// Writes a JPEG with the stripe's rows to buf: the same headers with a smaller height, and the
+// stripe's entropy coded data. Restart markers are renumbered, as a decoder expects RST0 first.
+static void stripe_jpeg(const unsigned char* d, const struct jpeg_layout* l, const struct stripe* st,
+                        unsigned char* buf) {
+    int k0, k1;
+    size_t begin, end;
+    stripe_data(l, st, &k0, &k1, &begin, &end);
+    memcpy(buf, d, l->scan_at);
+    int rows = l->mcu_h * (st->mcu_row1 - st->mcu_row0);
+    if (st->mcu_row1 == l->mcu_rows) {
+        rows = l->image_h - l->mcu_h * st->mcu_row0;
+    }
+    buf[l->height_at] = rows >> 8;
+    buf[l->height_at + 1] = rows & 0xFF;
+
+    unsigned char* out = buf + l->scan_at;
+    memcpy(out, d + begin, end - begin);
+    unsigned rst = 0;
+    for (int k = k0 + 1; k < k1; k++) {
+        out[l->intervals[k] - 1 - begin] = 0xD0 + (rst++ & 7);
+    }
+    out[end - begin] = 0xFF;
+    out[end - begin + 1] = 0xD9;
+}
+
+static void decode_stripe(void* usr, int i) {
+    struct stripe_job* job = usr;
+    struct stripe* st = &job->stripes[i];
+    struct jpeg_decoder* dec = &job->js->decs[i];
+    uint64_t trace_t = trace_begin();
+
+    // Part of the visible window this stripe covers, in output rows
+    const int y0 = st->mcu_row0 * job->layout->mcu_h / (int)job->scale_denom;
+    const int y1 = st->mcu_row1 * job->layout->mcu_h / (int)job->scale_denom;
+    const int wy0 = y0 > job->off_y ? y0 : job->off_y;
+    const int wy1 = y1 < job->off_y + job->visible_h ? y1 : job->off_y + job->visible_h;
+    if (wy0 >= wy1) {
+        return;
+    }
+
+    const size_t sz = stripe_jpeg_size(job->layout, st);
+    if (!mem_budget_reserve(MEM_DECODER, sz)) {
+        st->failed = true;
+        return;
+    }
+    unsigned char* buf = malloc(sz);
+    if (!buf) {
+        mem_budget_release(MEM_DECODER, sz);
+        st->failed = true;
+        return;
+    }
+    stripe_jpeg(job->data, job->layout, st, buf);
+
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_decode_err jerr;
+    cinfo.err = jpeg_decode_err_init(&jerr);
+    jpeg_create_decompress(&cinfo);
+    if (setjmp(jerr.jmp)) {
+        st->failed = true;
+    } else {
+        jpeg_mem_src(&cinfo, buf, sz);
+        jpeg_read_header(&cinfo, TRUE);
+        jpeg_decoder_setup(dec, &cinfo, 0, 0);
+        cinfo.scale_denom = job->scale_denom;
+        if (!jpeg_decoder_start(dec, &cinfo) || cinfo.output_width != job->out_w) {
+            st->failed = true;
+            jpeg_abort_decompress(&cinfo);
+        } else {
+            int x_in_row;
+            jpeg_decoder_set_window(dec, &cinfo, job->off_x, wy0 - y0, job->visible_w, wy1 - wy0,
+                                    &x_in_row);
+            int y = wy0;
+            int n;
+            while ((n = jpeg_decoder_read(dec, &cinfo)) > 0) {
+                for (int r = 0; r < n; r++, y++) {
+                    gray_conv_row(job->js->conv, dec->rows[r] + x_in_row * cinfo.output_components,
+                                  cinfo.output_components,
+                                  job->dst + (size_t)(y - job->off_y) * job->dst_w, job->visible_w);
+                }
+            }
+            st->failed = y != wy1;
+            jpeg_decoder_finish(dec, &cinfo);
+        }
+    }
+    jpeg_destroy_decompress(&cinfo);
+    mem_budget_release(MEM_DECODER, sz);
+    free(buf);
+    trace_end("decode stripe", trace_t);
+}
+
+// Reads the image's header to find how the serial decoder would scale and crop it
+static bool plan_output(struct jpeg_stripes* js, const unsigned char* data, size_t sz,
+                        int dst_w, int dst_h, struct stripe_job* job) {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_decode_err jerr;
+    cinfo.err = jpeg_decode_err_init(&jerr);
+    jpeg_create_decompress(&cinfo);
+    bool ok = false;
+    if (!setjmp(jerr.jmp)) {
+        jpeg_mem_src(&cinfo, data, sz);
+        jpeg_read_header(&cinfo, TRUE);
+        jpeg_decoder_setup(&js->decs[0], &cinfo, dst_w, dst_h);
+        jpeg_calc_output_dimensions(&cinfo);
+        job->scale_denom = cinfo.scale_denom;
+        job->out_w = cinfo.output_width;
+        int off_x = ((int)cinfo.output_width - dst_w) / 2;
+        int off_y = ((int)cinfo.output_height - dst_h) / 2;
+        job->off_x = off_x > 0 ? off_x : 0;
+        job->off_y = off_y > 0 ? off_y : 0;
+        job->visible_w = (int)cinfo.output_width - job->off_x;
+        if (job->visible_w > dst_w) job->visible_w = dst_w;
+        job->visible_h = (int)cinfo.output_height - job->off_y;
+        if (job->visible_h > dst_h) job->visible_h = dst_h;
+        ok = true;
+    }
+    jpeg_destroy_decompress(&cinfo);
+    return ok;
+}
+
+static int gcd(int a, int b) {
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+int jpeg_stripes_decode(struct jpeg_stripes* js, const unsigned char* data, size_t sz,
+                        unsigned char* dst, int dst_w, int dst_h) {
+    if (js->profile != JPEG_DECODE_FAST) {
+        return 0;
+    }
+    struct jpeg_layout layout;
+    if (!parse_layout(data, sz, &layout)) {
+        free(layout.intervals);
+        return 0;
+    }
+
+    // Stripes can only start at rows of MCUs that start a restart interval: every `unit` rows
+    const int unit = (int)layout.restart_interval / gcd(layout.mcus_per_row, (int)layout.restart_interval);
+    const int units = (layout.mcu_rows + unit - 1) / unit;
+    const int n = units < js->n_decs ? units : js->n_decs;
+    struct stripe* stripes = js->stripes;
+    struct stripe_job job = {
+        .js = js,
+        .data = data,
+        .layout = &layout,
+        .stripes = stripes,
+        .dst = dst,
+        .dst_w = dst_w,
+    };
+    if (n < 1 || !plan_output(js, data, sz, dst_w, dst_h, &job)) {
+        free(layout.intervals);
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        stripes[i].mcu_row0 = units * i / n * unit;
+        stripes[i].mcu_row1 = i == n - 1 ? layout.mcu_rows : units * (i + 1) / n * unit;
+        stripes[i].failed = false;
+    }
+
+    worker_pool_run(js->pool, decode_stripe, &job, n);
+    free(layout.intervals);
+
+    for (int i = 0; i < n; i++) {
+        if (stripes[i].failed) {
+            fprintf(stderr, "Failed to decode stripe %d of %d\n", i, n);
+            return 0;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "jpeg_decode.h"
+
+struct gray_conv;
+struct worker_pool;
+
+/**
+ * Decodes JPEGs with restart markers in parallel. A restart marker resets the
+ * entropy decoder, so the data between markers can be decoded on its own: an
+ * image is split into horizontal stripes at restart intervals that start a
+ * row of MCUs, and each stripe is decoded (and converted to gray) by a thread
+ * of a worker pool, as if it were an image of its own.
+ *
+ * Only for single scan (baseline or extended sequential) JPEGs in memory,
+ * and for the fast decode profile: with fancy upsampling, rows next to a
+ * stripe boundary would come out slightly different than in a serial decode.
+ * Anything else is left for the serial decoder. A single thread pool works
+ * too, but is slower than the serial decoder, as stripes are copied: it's
+ * only useful as a baseline to measure how decoding scales.
+ */
+struct jpeg_stripes;
+
+// pool must outlive the decoder
+struct jpeg_stripes* jpeg_stripes_new(struct worker_pool* pool, enum jpeg_decode_profile profile,
+                                      const struct gray_conv* conv);
+void jpeg_stripes_free(struct jpeg_stripes* js);
+
+/**
+ * Decodes data into dst, a dst_w x dst_h gray8 frame, scaled and cropped like
+ * the serial decoder would. Rows of dst the image doesn't cover are left as
+ * is. Returns the number of stripes decoded in parallel, or 0 if the image
+ * can't be split or any stripe failed (then dst may be half written, and the
+ * image should go through the serial decoder).
+ */
+int jpeg_stripes_decode(struct jpeg_stripes* js, const unsigned char* data, size_t sz,
+                        unsigned char* dst, int dst_w, int dst_h);
@@ -0,0 +1,221 @@
+// Load test of the img_client protocol: runs img_client against an image server (eg
+// tools/img_server.py, which can inject faults) like picrt -s does, taking one image every
+// interval, and measures how well prefetching keeps up. Prints one JSON object when done:
+//   {"images":30,"hit_rate":0.97,"time_to_image_ms":{"p50":0.0,...},"downloads":31,...}
+// An image is a hit if it was ready when it was due; time to image is how long after it was due
+// it was ready. The first image is reported on its own, as it includes registering.
+// img_client's own logs go to stderr, so stdout only has the result.
+//
+// Usage: picrt-loadtest server_url [images] [interval_sec] [jpeg|gray8|rgb565] [hedge|nohedge]
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mem_budget.h"
+#include "metrics.h"
+#include "raw_frame.h"
+#include "img_client/img_client.h"
+
+#define SCREEN_W 720
+#define SCREEN_H 576
+#define GAMMA .15
+#define PREFETCH_MAX_MB 16
+#define MEM_BUDGET_MB 96
+// An image that isn't ready this long after it was due is given up on
+#define IMAGE_WAIT_SEC 60
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void sleep_until_ms(double t) {
+    struct timespec ts = {
+        .tv_sec = (time_t)(t / 1e3),
+        .tv_nsec = (long)((t - (time_t)(t / 1e3) * 1e3) * 1e6),
+    };
+    while (!stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+/**
+ * Waits until img_client has an image, or until deadline (ms, CLOCK_MONOTONIC). Returns false if
+ * none arrived. *hit is true if it was there on the first try.
+ */
+static bool wait_image(struct img_client_ctx* ctx, double deadline, bool* hit,
+                       const unsigned char** data, size_t* sz) {
+    *hit = true;
+    struct pollfd pfd = { .fd = img_client_get_ready_fd(ctx), .events = POLLIN };
+    while (!stop) {
+        if (img_client_get_image(ctx, data, sz)) {
+            return true;
+        }
+        *hit = false;
+
+        const double left = deadline - now_ms();
+        if (left <= 0) {
+            return false;
+        }
+        int ret = poll(&pfd, 1, (int)left + 1);
+        if (ret < 0 && errno != EINTR) {
+            perror("poll");
+            return false;
+        }
+        if (ret > 0) {
+            uint64_t ready;
+            if (read(pfd.fd, &ready, sizeof(ready)) < 0 && errno != EAGAIN) {
+                perror("read ready_fd");
+            }
+        }
+    }
+    return false;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    const double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t i = (size_t)(p * (n - 1) + .5);
+    return sorted[i];
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s server_url [images] [interval_sec] [jpeg|gray8|rgb565] [hedge|nohedge]\n",
+                argv[0]);
+        return 1;
+    }
+    const char* url = argv[1];
+    const int images = argc > 2 ? atoi(argv[2]) : 30;
+    const int interval_sec = argc > 3 ? atoi(argv[3]) : 1;
+    const char* format = argc > 4 ? argv[4] : "gray8";
+    const bool hedge = argc > 5 ? strcmp(argv[5], "nohedge") != 0 : true;
+    enum raw_frame_format raw_format = RAW_FRAME_NONE;
+    if (!strcmp(format, "gray8")) {
+        raw_format = RAW_FRAME_GRAY8;
+    } else if (!strcmp(format, "rgb565")) {
+        raw_format = RAW_FRAME_RGB565;
+    } else if (strcmp(format, "jpeg")) {
+        fprintf(stderr, "Unknown format %s\n", format);
+        return 1;
+    }
+    if (images <= 0 || interval_sec <= 0) {
+        fprintf(stderr, "images and interval_sec must be positive\n");
+        return 1;
+    }
+
+    // Keep stdout for the result: anything img_client prints goes to stderr
+    FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+    if (!out || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        perror("Can't redirect stdout");
+        return 1;
+    }
+
+    // No SA_RESTART, so Ctrl-C interrupts waits and the results so far are still printed
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    mem_budget_init((size_t)MEM_BUDGET_MB * 1024 * 1024);
+
+    double* tti = calloc(images, sizeof(double));
+    if (!tti) {
+        fprintf(stderr, "bad alloc\n");
+        return 1;
+    }
+
+    const struct img_client_cfg cfg = {
+        .server_url = url,
+        .screen_w = SCREEN_W,
+        .screen_h = SCREEN_H,
+        .image_interval_sec = interval_sec,
+        .prefetch_max_bytes = PREFETCH_MAX_MB * 1024 * 1024,
+        .cache_dir = NULL,
+        .raw_format = raw_format,
+        .raw_compression = RAW_FRAME_DEFLATE,
+        .raw_gamma = GAMMA,
+        .hedge_downloads = hedge,
+    };
+    const double t_start = now_ms();
+    struct img_client_ctx* ctx = img_client_init(&cfg);
+    if (!ctx) {
+        free(tti);
+        return 1;
+    }
+
+    double first_image_ms = -1;
+    size_t shown = 0, hits = 0, n_tti = 0, timeouts = 0, bad_images = 0;
+    uint64_t image_bytes = 0;
+    for (int i = 0; i < images && !stop; i++) {
+        const double due = t_start + (double)i * interval_sec * 1000;
+        sleep_until_ms(due);
+        if (stop) break;
+
+        bool hit;
+        const unsigned char* data;
+        size_t sz;
+        if (!wait_image(ctx, now_ms() + IMAGE_WAIT_SEC * 1000, &hit, &data, &sz)) {
+            if (!stop) {
+                fprintf(stderr, "Image %d: nothing after %d s\n", i, IMAGE_WAIT_SEC);
+                timeouts++;
+            }
+            continue;
+        }
+
+        const double late_ms = now_ms() - due;
+        shown++;
+        image_bytes += sz;
+        // Should never happen: img_client drops downloads that fail this
+        if (!img_client_is_whole_image(data, sz)) {
+            bad_images++;
+        }
+        if (i == 0) {
+            first_image_ms = late_ms;
+        } else {
+            hits += hit;
+            tti[n_tti++] = late_ms;
+        }
+        fprintf(stderr, "Image %d: %zu bytes, %s, %.1f ms late\n", i, sz, hit ? "hit" : "miss", late_ms);
+    }
+    const double elapsed_sec = (now_ms() - t_start) / 1e3;
+    img_client_free(ctx);
+
+    qsort(tti, n_tti, sizeof(double), cmp_double);
+    const uint64_t dl_bytes = metrics_counter(METRIC_DOWNLOAD_BYTES);
+    fprintf(out, "{\"server\":\"%s\",\"format\":\"%s\",\"hedge\":%s,\"interval_sec\":%d,\"images\":%zu,"
+                 "\"elapsed_sec\":%.2f,\"first_image_ms\":%.1f,\"hit_rate\":%.3f,"
+                 "\"time_to_image_ms\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+                 "\"timeouts\":%zu,\"bad_images\":%zu,\"image_kb\":%.1f,"
+                 "\"downloads\":%llu,\"download_failures\":%llu,\"hedged_downloads\":%llu,"
+                 "\"download_mb_per_sec\":%.3f}\n",
+            url, format, hedge ? "true" : "false", interval_sec, shown, elapsed_sec, first_image_ms,
+            n_tti ? (double)hits / n_tti : 0.,
+            percentile(tti, n_tti, .5), percentile(tti, n_tti, .9), percentile(tti, n_tti, .99),
+            n_tti ? tti[n_tti - 1] : 0.,
+            timeouts, bad_images, shown ? image_bytes / 1024. / shown : 0.,
+            (unsigned long long)metrics_counter(METRIC_DOWNLOADS),
+            (unsigned long long)metrics_counter(METRIC_DOWNLOAD_FAILURES),
+            (unsigned long long)metrics_counter(METRIC_HEDGED_DOWNLOADS),
+            dl_bytes / 1e6 / elapsed_sec);
+    fclose(out);
+    free(tti);
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "mem_budget.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+static const char* subsys_names[MEM_SUBSYS_COUNT] = {
+    "download", "prefetch", "stream", "disk cache", "decoder", "frames",
+};
+
+static size_t limit = SIZE_MAX;
+static atomic_size_t total;
+static atomic_size_t total_peak;
+static atomic_size_t used[MEM_SUBSYS_COUNT];
+static atomic_size_t peak[MEM_SUBSYS_COUNT];
+
+static void update_peak(atomic_size_t* p, size_t val) {
+    size_t cur = atomic_load_explicit(p, memory_order_relaxed);
+    while (val > cur && !atomic_compare_exchange_weak_explicit(p, &cur, val, memory_order_relaxed,
+                                                               memory_order_relaxed)) {
+    }
+}
+
+static void add_used(enum mem_subsys s, size_t bytes) {
+    size_t now = atomic_fetch_add_explicit(&used[s], bytes, memory_order_relaxed) + bytes;
+    update_peak(&peak[s], now);
+}
+
+void mem_budget_init(size_t limit_bytes) {
+    limit = limit_bytes > 0 ? limit_bytes : SIZE_MAX;
+}
+
+bool mem_budget_reserve(enum mem_subsys s, size_t bytes) {
+    size_t cur = atomic_load_explicit(&total, memory_order_relaxed);
+    do {
+        if (bytes > limit || cur > limit - bytes) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&total, &cur, cur + bytes, memory_order_relaxed,
+                                                    memory_order_relaxed));
+    update_peak(&total_peak, cur + bytes);
+    add_used(s, bytes);
+    return true;
+}
+
+void mem_budget_add(enum mem_subsys s, size_t bytes) {
+    size_t now = atomic_fetch_add_explicit(&total, bytes, memory_order_relaxed) + bytes;
+    update_peak(&total_peak, now);
+    add_used(s, bytes);
+}
+
+void mem_budget_release(enum mem_subsys s, size_t bytes) {
+    atomic_fetch_sub_explicit(&used[s], bytes, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&total, bytes, memory_order_relaxed);
+}
+
+void mem_budget_move(enum mem_subsys from, enum mem_subsys to, size_t bytes) {
+    if (from == to || bytes == 0) return;
+    add_used(to, bytes);
+    atomic_fetch_sub_explicit(&used[from], bytes, memory_order_relaxed);
+}
+
+size_t mem_budget_available(void) {
+    if (limit == SIZE_MAX) return SIZE_MAX;
+    size_t cur = atomic_load_explicit(&total, memory_order_relaxed);
+    return cur < limit ? limit - cur : 0;
+}
+
+void mem_budget_report(void) {
+    // statm is in pages: total, resident, ...
+    long rss_kb = -1;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        long pages, resident;
+        if (fscanf(f, "%ld %ld", &pages, &resident) == 2) {
+            rss_kb = resident * (sysconf(_SC_PAGESIZE) / 1024);
+        }
+        fclose(f);
+    }
+    struct rusage ru;
+    long peak_rss_kb = getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : -1;
+    // maxrss is only updated every so often by the kernel
+    if (peak_rss_kb < rss_kb) peak_rss_kb = rss_kb;
+
+    printf("Memory: %zu KB used, %zu KB peak", atomic_load(&total) / 1024, atomic_load(&total_peak) / 1024);
+    if (limit != SIZE_MAX) {
+        printf(", budget %zu KB", limit / 1024);
+    }
+    printf("; RSS %ld KB, peak %ld KB\n", rss_kb, peak_rss_kb);
+    for (int i = 0; i < MEM_SUBSYS_COUNT; i++) {
+        printf("  %-10s %8zu KB used, %8zu KB peak\n", subsys_names[i],
+               atomic_load(&used[i]) / 1024, atomic_load(&peak[i]) / 1024);
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Process-wide accounting of the big allocations: image buffers, decoder
+ * working memory and the like. Each subsystem reserves what it's about to
+ * allocate, and a reservation that would go over the budget fails, so the
+ * caller can give up on one oversized image instead of the OOM killer giving
+ * up on picrt. Small allocations aren't tracked.
+ *
+ * Thread safe. Without mem_budget_init there is no limit, but usage is still
+ * tracked.
+ */
+enum mem_subsys {
+    MEM_DOWNLOAD,    // Buffers of downloads in flight
+    MEM_PREFETCH,    // Prefetched images, and their recycled buffers
+    MEM_STREAM,      // Images decoded while downloading
+    MEM_DISK_CACHE,  // Images waiting to be written to disk
+    MEM_DECODER,     // Decoder rows, and libjpeg's working memory
+    MEM_FRAMES,      // Off-screen frames for transitions
+    MEM_SUBSYS_COUNT,
+};
+
+void mem_budget_init(size_t limit_bytes);
+
+/**
+ * Accounts for bytes about to be allocated by s. Returns false, and accounts
+ * nothing, if it would go over the budget.
+ */
+bool mem_budget_reserve(enum mem_subsys s, size_t bytes);
+
+// Accounts for bytes without checking the budget, eg for memory that's already allocated
+void mem_budget_add(enum mem_subsys s, size_t bytes);
+void mem_budget_release(enum mem_subsys s, size_t bytes);
+
+// Changes the owner of already accounted memory
+void mem_budget_move(enum mem_subsys from, enum mem_subsys to, size_t bytes);
+
+// Bytes that can still be reserved, SIZE_MAX if there's no limit
+size_t mem_budget_available(void);
+
+// Prints current and peak usage per subsystem, and the process' RSS
+void mem_budget_report(void);
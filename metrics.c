@@ -0,0 +1,114 @@
+#include "metrics.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+// Bucket i counts samples <= 2^i us; the last one is +Inf
+#define HIST_BUCKETS 28
+
+struct metric_hist_data {
+    atomic_uint_fast64_t buckets[HIST_BUCKETS];
+    atomic_uint_fast64_t sum_us;
+};
+
+static const char* counter_names[METRIC_COUNTER_COUNT] = {
+    "picrt_images_shown_total",
+    "picrt_decode_failures_total",
+    "picrt_prefetch_hits_total",
+    "picrt_prefetch_misses_total",
+    "picrt_disk_cache_images_total",
+    "picrt_downloads_total",
+    "picrt_download_failures_total",
+    "picrt_download_bytes_total",
+    "picrt_hedged_downloads_total",
+};
+
+static const char* hist_names[METRIC_HIST_COUNT] = {
+    "download", "queue_wait", "jpeg_header", "decode", "convert", "reveal", "flip",
+};
+
+static atomic_uint_fast64_t counters[METRIC_COUNTER_COUNT];
+static struct metric_hist_data hists[METRIC_HIST_COUNT];
+
+void metrics_inc(enum metric_counter c, uint64_t n) {
+    atomic_fetch_add_explicit(&counters[c], n, memory_order_relaxed);
+}
+
+uint64_t metrics_counter(enum metric_counter c) {
+    return atomic_load_explicit(&counters[c], memory_order_relaxed);
+}
+
+static int bucket_for(uint64_t us) {
+    if (us <= 1) return 0;
+    // Smallest i with us <= 2^i
+    int i = 64 - __builtin_clzll(us - 1);
+    return i < HIST_BUCKETS - 1 ? i : HIST_BUCKETS - 1;
+}
+
+void metrics_observe_us(enum metric_hist h, uint64_t us) {
+    atomic_fetch_add_explicit(&hists[h].buckets[bucket_for(us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hists[h].sum_us, us, memory_order_relaxed);
+}
+
+void metrics_observe_since(enum metric_hist h, const struct timespec* t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    int64_t us = (t1.tv_sec - t0->tv_sec) * 1000000 + (t1.tv_nsec - t0->tv_nsec) / 1000;
+    metrics_observe_us(h, us > 0 ? (uint64_t)us : 0);
+}
+
+static void write_hist(FILE* f, const char* name, struct metric_hist_data* hist) {
+    // Prometheus buckets are cumulative
+    uint64_t count = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        count += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+        if (i < HIST_BUCKETS - 1) {
+            fprintf(f, "picrt_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                    name, (double)(1ull << i) / 1e6, (unsigned long long)count);
+        } else {
+            fprintf(f, "picrt_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                    name, (unsigned long long)count);
+        }
+    }
+    fprintf(f, "picrt_stage_duration_seconds_sum{stage=\"%s\"} %g\n",
+            name, atomic_load_explicit(&hist->sum_us, memory_order_relaxed) / 1e6);
+    fprintf(f, "picrt_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+            name, (unsigned long long)count);
+}
+
+bool metrics_write_prom(const char* path) {
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        fprintf(stderr, "Metrics path too long: %s\n", path);
+        return false;
+    }
+
+    FILE* f = fopen(tmp_path, "w");
+    if (!f) {
+        perror(tmp_path);
+        return false;
+    }
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        fprintf(f, "# TYPE %s counter\n%s %llu\n", counter_names[i], counter_names[i],
+                (unsigned long long)atomic_load_explicit(&counters[i], memory_order_relaxed));
+    }
+
+    fprintf(f, "# HELP picrt_stage_duration_seconds Time spent per image in each stage\n");
+    fprintf(f, "# TYPE picrt_stage_duration_seconds histogram\n");
+    for (int i = 0; i < METRIC_HIST_COUNT; i++) {
+        write_hist(f, hist_names[i], &hists[i]);
+    }
+
+    if (fclose(f) != 0) {
+        perror(tmp_path);
+        remove(tmp_path);
+        return false;
+    }
+    if (rename(tmp_path, path) != 0) {
+        perror(path);
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
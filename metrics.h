@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Process-wide counters and latency histograms, exported as a Prometheus text
+ * file (eg for node_exporter's textfile collector). Histograms have log2
+ * buckets, from 1us to about a minute, so recording a sample is a couple of
+ * atomic adds and doesn't need any configuration per stage.
+ *
+ * Thread safe.
+ */
+enum metric_counter {
+    METRIC_IMAGES_SHOWN,
+    METRIC_DECODE_FAILURES,
+    METRIC_PREFETCH_HITS,       // An image was due, and one was prefetched
+    METRIC_PREFETCH_MISSES,     // An image was due, and none was prefetched
+    METRIC_DISK_CACHE_IMAGES,   // Images shown from the disk cache
+    METRIC_DOWNLOADS,
+    METRIC_DOWNLOAD_FAILURES,
+    METRIC_DOWNLOAD_BYTES,
+    METRIC_HEDGED_DOWNLOADS,    // Second downloads started next to a slow one
+    METRIC_COUNTER_COUNT,
+};
+
+enum metric_hist {
+    METRIC_DOWNLOAD,      // Prefetch download, start to end
+    METRIC_QUEUE_WAIT,    // Prefetched image waiting to be shown
+    METRIC_JPEG_HEADER,   // Reading the JPEG header
+    METRIC_DECODE,        // Decoding one image, without conversion
+    METRIC_CONVERT,       // Gray conversion of one image
+    METRIC_REVEAL,        // First to last scanline on screen
+    METRIC_FLIP,          // Presenting a frame
+    METRIC_HIST_COUNT,
+};
+
+void metrics_inc(enum metric_counter c, uint64_t n);
+uint64_t metrics_counter(enum metric_counter c);
+
+void metrics_observe_us(enum metric_hist h, uint64_t us);
+// Observes the time elapsed since t0 (CLOCK_MONOTONIC)
+void metrics_observe_since(enum metric_hist h, const struct timespec* t0);
+
+/**
+ * Rewrites path with the current value of all metrics. The file is replaced
+ * atomically, so a scraper never sees half of it. Returns false on error.
+ */
+bool metrics_write_prom(const char* path);
@@ -3,14 +3,30 @@
 #include <stdlib.h>
 #include <jpeglib.h>
 
+#include <limits.h>
 #include <math.h>
+#include <setjmp.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include <time.h>
 
+#include "gray_conv.h"
+#include "jpeg_decode.h"
+#include "jpeg_stripes.h"
+#include "mem_budget.h"
+#include "metrics.h"
+#include "raw_frame.h"
+#include "trace.h"
+#include "transition.h"
+#include "worker_pool.h"
 #include "img_client/img_client.h"
 
 #include "screen.h"
@@ -19,239 +35,958 @@
 // okay for old CRTs
 #define GAMMA .15
 
+// libjpeg decode profile, see jpeg_decode.h. JPEG_DECODE_FAST decodes straight to gray with a fast
+// IDCT, JPEG_DECODE_QUALITY is libjpeg's default (slower, sharper) decode.
+#define JPEG_PROFILE JPEG_DECODE_FAST
+
+// Threads for work that can be split: transition frames, and decoding JPEGs with restart markers
+// (see jpeg_stripes.h). 0 for one per core.
+#define WORKER_THREADS 0
+
 // Image server
 #define IMG_SERVER_URL "http://bati.casa:5000/"
 
-// Sleep between imgs
+// Ask the image server for frames already sized and gamma corrected for the screen, see raw_frame.h,
+// so there's nothing to decode. RAW_FRAME_NONE to always get JPEGs; servers that don't support raw
+// frames send JPEGs anyway.
+#define IMG_RAW_FORMAT RAW_FRAME_GRAY8
+#define IMG_RAW_COMPRESSION RAW_FRAME_DEFLATE
+
+// Downloaded images are kept on disk, to have something to show when the image server is down: in
+// $PICRT_CACHE_DIR if set, else in picrt under $XDG_CACHE_HOME or ~/.cache, so it works without root.
+// Set to 0 to disable.
+#define IMG_CACHE_MAX_MB 64
+
+// Sleep between imgs. Downloads time out after a couple of intervals.
 #define IMAGE_INTERVAL_SEC 10
 
-// Delay per scanline during reveal (microseconds), used when rendering a picture to the screen.
-// Without this, the picture is displayed immediately, which is obviously wrong because a CRT
-// is old so it must be slow. 500us will be about 300ms to display an image, 1ms will be about half
-// a second. Set to zero to disable effect.
-#define SCANLINE_DELAY_US 1000
+// Memory for images downloaded ahead of time. How many are prefetched adapts to download times.
+#define PREFETCH_MAX_MB 16
+// When nothing is prefetched and a download is much slower than usual, start another one next to it.
+// Costs the server an extra request now and then; false to wait for the slow one only.
+#define PREFETCH_HEDGE true
+
+// Budget for image buffers and decoder memory; an image that needs more than what's left is skipped
+// instead of risking the OOM killer. 0 for no limit. Usage is printed every MEM_REPORT_SEC.
+#define MEM_BUDGET_MB 96
+#define MEM_REPORT_SEC 60
+
+// Metrics in Prometheus text format, rewritten every METRICS_SEC for node_exporter's textfile
+// collector. Enabled by setting PICRT_METRICS to the path of the file (eg
+// /var/lib/prometheus/node-exporter/picrt.prom, which must be writable by the user picrt runs as).
+#define METRICS_SEC 15
+
+// Spans kept per thread when tracing, see trace.h. Tracing is enabled by setting PICRT_TRACE to the
+// path of the trace file; it's written on exit, or on SIGUSR1.
+#define TRACE_RING_EVENTS (64 * 1024)
+
+// How a new picture replaces the old one, see transition.h. Without a transition the picture is
+// displayed immediately, which is obviously wrong because a CRT is old so it must be slow.
+// TRANSITION_WIPE reveals it one scanline at a time, TRANSITION_CROSSFADE and TRANSITION_DISSOLVE
+// blend it in, TRANSITION_CUT disables the effect. Transitions run at TRANSITION_FPS and take
+// TRANSITION_MS, regardless of how long the picture took to decode.
+#define TRANSITION_EFFECT TRANSITION_WIPE
+#define TRANSITION_MS 600
+#define TRANSITION_FPS 30
+
+// Lissajous mode frame rate, and how often to print its frame timings
+#define LISSAJOUS_FPS 60
+#define LISSAJOUS_STATS_SEC 5
+#define LISSAJOUS_TRAIL 2000
 
 sig_atomic_t running = 1;
+static volatile sig_atomic_t dump_trace = 0;
+static const char* trace_path = NULL;
+static const char* metrics_path = NULL;
+
+// Signals are blocked and read from here, by the loops that wait for them, so nothing has to wake up
+// periodically to check for them. -1 if signalfd isn't available; handle_signal is then a plain
+// signal handler.
+static int signal_fd = -1;
+
+// For time to first pixel
+static struct timespec startup_time;
+static bool first_pixel_shown = false;
+
+static void handle_signal(int sig) {
+    if (sig == SIGUSR1) {
+        dump_trace = 1;
+    } else {
+        running = 0;
+    }
+}
 
-static void sighandler(int sig) {
-    (void)sig;
-    running = 0;
+// Handles pending signals. Long running work calls this to notice them. Returns false if we should
+// exit.
+static bool poll_signals(void) {
+    if (signal_fd >= 0) {
+        struct signalfd_siginfo si;
+        while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+            handle_signal(si.ssi_signo);
+        }
+    }
+    if (dump_trace) {
+        trace_dump(trace_path);
+        dump_trace = 0;
+    }
+    return running;
 }
 
-static void render_jpeg(struct screen* s, const char* path, double gamma) {
-    FILE* f = fopen(path, "rb");
-    if (!f) {
-        perror(path);
+static void setup_signals(bool trace) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    if (trace) sigaddset(&mask, SIGUSR1);
+
+    // Before starting any thread, so they all inherit the mask and signals only go to signal_fd
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == 0) {
+        signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signal_fd >= 0) return;
+        perror("signalfd");
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGHUP, handle_signal);
+    if (trace) signal(SIGUSR1, handle_signal);
+}
+
+static bool epoll_watch(int epoll_fd, int fd) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+// Creates an epoll instance that wakes up on signals. Returns -1 on error.
+static int event_loop_new(void) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    if (signal_fd >= 0 && !epoll_watch(epoll_fd, signal_fd)) {
+        close(epoll_fd);
+        return -1;
+    }
+    return epoll_fd;
+}
+
+// Sleeps until a signal arrives or a watched fd is readable, and handles signals. Returns the number
+// of ready events in evs.
+static int wait_events(int epoll_fd, struct epoll_event* evs, int max_evs) {
+    int n = epoll_wait(epoll_fd, evs, max_evs, -1);
+    if (n < 0 && errno != EINTR) {
+        perror("epoll_wait");
+        running = 0;
+    }
+    poll_signals();
+    return n < 0 ? 0 : n;
+}
+
+// Clears an eventfd or timerfd
+static void drain_fd(int fd) {
+    uint64_t cnt;
+    while (read(fd, &cnt, sizeof(cnt)) == sizeof(cnt)) {}
+}
+
+static void timespec_add_ms(struct timespec* t, long ms) {
+    t->tv_sec += ms / 1000;
+    t->tv_nsec += (ms % 1000) * 1000000L;
+    if (t->tv_nsec >= 1000000000L) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
+// Makes timer_fd fire at deadline, on CLOCK_MONOTONIC. Fires right away if deadline is past.
+static void arm_timer(int timer_fd, const struct timespec* deadline) {
+    struct itimerspec its = { .it_value = *deadline };
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        perror("timerfd_settime");
+    }
+}
+
+static double ms_since(const struct timespec* t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+static void log_first_pixel(const char* what) {
+    if (first_pixel_shown) return;
+    first_pixel_shown = true;
+    printf("Time to first pixel: %.1f ms (%s)\n", ms_since(&startup_time), what);
+}
+
+// Shows the transition's next frame, once it's complete
+static void present_frame(struct screen* s, struct transition* tr) {
+    if (!running) {
         return;
     }
 
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_decompress(&cinfo);
-    jpeg_stdio_src(&cinfo, f);
-    jpeg_read_header(&cinfo, TRUE);
-
-    unsigned int denoms[] = {1, 2, 4, 8};
-    cinfo.scale_num = 1;
-    cinfo.scale_denom = 1;
-    for (int i = 0; i < 4; i++) {
-        if ((int)(cinfo.image_width / denoms[i]) >= s->width &&
-            (int)(cinfo.image_height / denoms[i]) >= s->height) {
-            cinfo.scale_denom = denoms[i];
-        }
+    log_first_pixel("image");
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t trace_t = trace_begin();
+    transition_run(tr, s, poll_signals);
+    trace_end("transition", trace_t);
+    metrics_observe_since(METRIC_REVEAL, &t0);
+    metrics_inc(METRIC_IMAGES_SHOWN, 1);
+}
+
+// Decodes an image from a libjpeg source that's ready to read its header into the transition's
+// off-screen frame, then presents it with the transition. Decode errors longjmp out of here, to
+// the caller's jpeg_decode_err handler.
+static void render_jpeg_decompress(struct screen* s, struct transition* tr, struct jpeg_decoder* dec,
+                                   const struct gray_conv* conv,
+                                   struct jpeg_decompress_struct* cinfo) {
+    struct timespec start, t0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t trace_t = trace_begin();
+    jpeg_read_header(cinfo, TRUE);
+    trace_end("jpeg header", trace_t);
+    const double header_ms = ms_since(&start);
+    metrics_observe_us(METRIC_JPEG_HEADER, header_ms * 1000);
+    jpeg_decoder_setup(dec, cinfo, tr->width, tr->height);
+    trace_t = trace_begin();
+    if (!jpeg_decoder_start(dec, cinfo)) {
+        jpeg_abort_decompress(cinfo);
+        return;
     }
+    trace_end("decoder start", trace_t);
+
+    double decode_ms = ms_since(&start);
+    double conv_ms = 0;
 
-    jpeg_start_decompress(&cinfo);
+    printf("JPEG: %dx%d -> %dx%d (1/%d), screen %dx%d\n",
+           cinfo->image_width, cinfo->image_height,
+           cinfo->output_width, cinfo->output_height,
+           cinfo->scale_denom, s->width, s->height);
 
-    int off_x = ((int)cinfo.output_width - s->width) / 2;
-    int off_y = ((int)cinfo.output_height - s->height) / 2;
+    int off_x = ((int)cinfo->output_width - tr->width) / 2;
+    int off_y = ((int)cinfo->output_height - tr->height) / 2;
     if (off_x < 0) off_x = 0;
     if (off_y < 0) off_y = 0;
 
-    int row_stride = cinfo.output_width * cinfo.output_components;
-    unsigned char *row = malloc(row_stride);
-    int y = 0;
-
-    screen_clear(s);
-    while (cinfo.output_scanline < cinfo.output_height && running) {
-        jpeg_read_scanlines(&cinfo, &row, 1);
-        int sy = y - off_y;
-        if (sy >= 0 && sy < s->height) {
-            for (int x = 0; x < s->width && (x + off_x) < (int)cinfo.output_width; x++) {
-                int src = (x + off_x) * cinfo.output_components;
-                unsigned char r = row[src];
-                unsigned char g = (cinfo.output_components >= 3) ? row[src + 1] : r;
-                unsigned char b = (cinfo.output_components >= 3) ? row[src + 2] : r;
-                unsigned char val = (unsigned char)(255.0 * pow((0.299 * r + 0.587 * g + 0.114 * b) / 255.0, gamma));
-                screen_set_pixel(s, x, sy, val);
+    int visible_w = (int)cinfo->output_width - off_x;
+    if (visible_w > tr->width) visible_w = tr->width;
+    int visible_h = (int)cinfo->output_height - off_y;
+    if (visible_h > tr->height) visible_h = tr->height;
+
+    // Don't decode what would be cropped out
+    int x_in_row;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    jpeg_decoder_set_window(dec, cinfo, off_x, off_y, visible_w, visible_h, &x_in_row);
+    decode_ms += ms_since(&t0);
+
+    // Already gray and not cropped horizontally: libjpeg writes rows straight into the frame, and
+    // gamma is applied in place. Otherwise rows are decoded to dec->rows and converted into the frame.
+    const bool direct = cinfo->output_components == 1 && x_in_row == 0 &&
+                        (int)cinfo->output_width <= tr->width;
+
+    // Borders stay black if the image is smaller than the screen
+    memset(tr->next, 0, (size_t)tr->width * tr->height);
+    int y = off_y;
+    while (poll_signals()) {
+        unsigned char* frame_row = tr->next + (size_t)(y - off_y) * tr->width;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        trace_t = trace_begin();
+        int n = direct ? jpeg_decoder_read_into(dec, cinfo, frame_row, tr->width)
+                       : jpeg_decoder_read(dec, cinfo);
+        trace_end("decode", trace_t);
+        decode_ms += ms_since(&t0);
+        if (n == 0) break;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (direct) {
+            for (int i = 0; i < n; i++, y++) {
+                unsigned char* row = frame_row + (size_t)i * tr->width;
+                gray_conv_row_gray(conv, row, row, visible_w);
             }
-            screen_flip(s);
-            if (SCANLINE_DELAY_US) usleep(SCANLINE_DELAY_US);
+            conv_ms += ms_since(&t0);
+            continue;
         }
-        y++;
+        for (int i = 0; i < n; i++, y++) {
+            int sy = y - off_y;
+            if (sy < 0 || sy >= tr->height) continue;
+            gray_conv_row(conv, dec->rows[i] + x_in_row * cinfo->output_components,
+                          cinfo->output_components, tr->next + (size_t)sy * tr->width, visible_w);
+        }
+        conv_ms += ms_since(&t0);
     }
 
-    free(row);
-    jpeg_finish_decompress(&cinfo);
+    metrics_observe_us(METRIC_DECODE, (decode_ms - header_ms) * 1000);
+    metrics_observe_us(METRIC_CONVERT, conv_ms * 1000);
+    printf("Decoded in %.1f ms (%s profile%s), converted in %.1f ms\n",
+           decode_ms, jpeg_decode_profile_name(dec->profile), direct ? ", direct" : "", conv_ms);
+
+    jpeg_decoder_finish(dec, cinfo);
+    present_frame(s, tr);
+}
+
+static void render_jpeg(struct screen* s, struct transition* tr, struct jpeg_decoder* dec,
+                        const struct gray_conv* conv, const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return;
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_decode_err jerr;
+    cinfo.err = jpeg_decode_err_init(&jerr);
+    jpeg_create_decompress(&cinfo);
+    if (setjmp(jerr.jmp)) {
+        fprintf(stderr, "Failed to decode %s\n", path);
+        metrics_inc(METRIC_DECODE_FAILURES, 1);
+    } else {
+        jpeg_stdio_src(&cinfo, f);
+        render_jpeg_decompress(s, tr, dec, conv, &cinfo);
+    }
     jpeg_destroy_decompress(&cinfo);
     fclose(f);
 }
 
-static void render_jpeg_from_mem(struct screen* s, const unsigned char* data, size_t sz, double gamma) {
+static void render_jpeg_from_mem(struct screen* s, struct transition* tr, struct jpeg_decoder* dec,
+                                 const struct gray_conv* conv,
+                                 const unsigned char* data, size_t sz) {
     struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    cinfo.err = jpeg_std_error(&jerr);
+    struct jpeg_decode_err jerr;
+    cinfo.err = jpeg_decode_err_init(&jerr);
     jpeg_create_decompress(&cinfo);
-    jpeg_mem_src(&cinfo, data, sz);
-    jpeg_read_header(&cinfo, TRUE);
-
-    unsigned int denoms[] = {1, 2, 4, 8};
-    cinfo.scale_num = 1;
-    cinfo.scale_denom = 1;
-    for (int i = 0; i < 4; i++) {
-        if ((int)(cinfo.image_width / denoms[i]) >= s->width &&
-            (int)(cinfo.image_height / denoms[i]) >= s->height) {
-            cinfo.scale_denom = denoms[i];
-        }
+    if (setjmp(jerr.jmp)) {
+        fprintf(stderr, "Failed to decode image (%zu bytes)\n", sz);
+        metrics_inc(METRIC_DECODE_FAILURES, 1);
+    } else {
+        jpeg_mem_src(&cinfo, data, sz);
+        render_jpeg_decompress(s, tr, dec, conv, &cinfo);
     }
+    jpeg_destroy_decompress(&cinfo);
+}
 
-    jpeg_start_decompress(&cinfo);
-    printf("JPEG: %dx%d -> %dx%d (1/%d), screen %dx%d\n",
-           cinfo.image_width, cinfo.image_height,
-           cinfo.output_width, cinfo.output_height,
-           cinfo.scale_denom, s->width, s->height);
+static bool raw_frame_start(struct transition* tr, const struct gray_conv* conv,
+                            struct raw_frame_decoder* rf, const struct raw_frame_header* hdr) {
+    printf("Raw frame: %dx%d %s, %s, screen %dx%d\n", hdr->width, hdr->height,
+           raw_frame_format_name(hdr->format), raw_frame_compression_name(hdr->compression),
+           tr->width, tr->height);
+    if (!raw_frame_decoder_start(rf, hdr, conv, tr->next, tr->width, tr->height)) {
+        return false;
+    }
+    // Borders stay black if the frame is smaller than the screen
+    if (hdr->width < tr->width || hdr->height < tr->height) {
+        memset(tr->next, 0, (size_t)tr->width * tr->height);
+    }
+    return true;
+}
 
-    int off_x = ((int)cinfo.output_width - s->width) / 2;
-    int off_y = ((int)cinfo.output_height - s->height) / 2;
-    if (off_x < 0) off_x = 0;
-    if (off_y < 0) off_y = 0;
+// Ends a raw frame, and shows it if it decoded fine
+static void raw_frame_end(struct screen* s, struct transition* tr, struct raw_frame_decoder* rf,
+                          bool ok, const struct timespec* start) {
+    ok = raw_frame_decoder_finish(rf) && ok;
+    metrics_observe_since(METRIC_DECODE, start);
+    if (!ok) {
+        fprintf(stderr, "Failed to decode raw frame\n");
+        metrics_inc(METRIC_DECODE_FAILURES, 1);
+        return;
+    }
+    printf("Decoded raw frame in %.1f ms\n", ms_since(start));
+    present_frame(s, tr);
+}
 
-    int row_stride = cinfo.output_width * cinfo.output_components;
-    unsigned char *row = malloc(row_stride);
-    int y = 0;
+// Raw frames only need copying into place, see raw_frame.h
+static void render_raw_from_mem(struct screen* s, struct transition* tr, const struct gray_conv* conv,
+                                const unsigned char* data, size_t sz) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct raw_frame_header hdr;
+    struct raw_frame_decoder rf;
+    if (!raw_frame_parse_header(data, sz, &hdr) || !raw_frame_start(tr, conv, &rf, &hdr)) {
+        metrics_inc(METRIC_DECODE_FAILURES, 1);
+        return;
+    }
+    size_t payload_sz = sz - RAW_FRAME_HEADER_SZ;
+    if (payload_sz > hdr.payload_sz) payload_sz = hdr.payload_sz;
+    uint64_t trace_t = trace_begin();
+    bool ok = raw_frame_decoder_feed(&rf, data + RAW_FRAME_HEADER_SZ, payload_sz);
+    trace_end("raw frame", trace_t);
+    raw_frame_end(s, tr, &rf, ok, &start);
+}
 
-    screen_clear(s);
-    while (cinfo.output_scanline < cinfo.output_height && running) {
-        jpeg_read_scanlines(&cinfo, &row, 1);
-        int sy = y - off_y;
-        if (sy >= 0 && sy < s->height) {
-            for (int x = 0; x < s->width && (x + off_x) < (int)cinfo.output_width; x++) {
-                int src = (x + off_x) * cinfo.output_components;
-                unsigned char r = row[src];
-                unsigned char g = (cinfo.output_components >= 3) ? row[src + 1] : r;
-                unsigned char b = (cinfo.output_components >= 3) ? row[src + 2] : r;
-                unsigned char val = (unsigned char)(255.0 * pow((0.299 * r + 0.587 * g + 0.114 * b) / 255.0, gamma));
-                screen_set_pixel(s, x, sy, val);
-            }
-            screen_flip(s);
-            if (SCANLINE_DELAY_US) usleep(SCANLINE_DELAY_US);
+// Decodes a JPEG in stripes across the worker pool. Returns false if it has to be decoded serially.
+static bool render_jpeg_stripes(struct screen* s, struct transition* tr, struct jpeg_stripes* stripes,
+                                const unsigned char* data, size_t sz) {
+    if (!stripes) {
+        return false;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t trace_t = trace_begin();
+    // Borders stay black if the image is smaller than the screen
+    memset(tr->next, 0, (size_t)tr->width * tr->height);
+    const int n = jpeg_stripes_decode(stripes, data, sz, tr->next, tr->width, tr->height);
+    trace_end("decode stripes", trace_t);
+    if (n == 0) {
+        return false;
+    }
+    metrics_observe_since(METRIC_DECODE, &start);
+    printf("Decoded in %.1f ms (%d stripes)\n", ms_since(&start), n);
+    present_frame(s, tr);
+    return true;
+}
+
+// Images from the server or the disk cache may be JPEGs or raw frames
+static void render_from_mem(struct screen* s, struct transition* tr, struct jpeg_decoder* dec,
+                            struct jpeg_stripes* stripes, const struct gray_conv* conv,
+                            const unsigned char* data, size_t sz) {
+    if (raw_frame_sniff(data, sz)) {
+        render_raw_from_mem(s, tr, conv, data, sz);
+    } else if (!render_jpeg_stripes(s, tr, stripes, data, sz)) {
+        render_jpeg_from_mem(s, tr, dec, conv, data, sz);
+    }
+}
+
+struct stream_src {
+    struct img_stream* st;
+    // First chunk, read before creating the decoder to check there is an image at all
+    const unsigned char* first;
+    size_t first_sz;
+};
+
+static ssize_t stream_wait_chunk(struct img_stream* st, const unsigned char** chunk) {
+    while (poll_signals()) {
+        ssize_t n = img_stream_next(st, chunk, 100);
+        if (n >= 0) return n;
+    }
+    return 0;
+}
+
+static size_t stream_next_chunk(void* usr, const unsigned char** chunk) {
+    struct stream_src* src = usr;
+    if (src->first) {
+        *chunk = src->first;
+        src->first = NULL;
+        return src->first_sz;
+    }
+    return stream_wait_chunk(src->st, chunk);
+}
+
+// Decodes a raw frame as it's downloaded, starting from its first chunk
+static void render_raw_from_stream(struct screen* s, struct transition* tr, const struct gray_conv* conv,
+                                   struct img_stream* st, const unsigned char* chunk, size_t n) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // The header may be split across chunks
+    unsigned char hdr_buf[RAW_FRAME_HEADER_SZ];
+    size_t hdr_sz = 0;
+    while (hdr_sz < RAW_FRAME_HEADER_SZ) {
+        const size_t take = n < RAW_FRAME_HEADER_SZ - hdr_sz ? n : RAW_FRAME_HEADER_SZ - hdr_sz;
+        memcpy(hdr_buf + hdr_sz, chunk, take);
+        hdr_sz += take;
+        chunk += take;
+        n -= take;
+        if (hdr_sz < RAW_FRAME_HEADER_SZ) {
+            ssize_t next = stream_wait_chunk(st, &chunk);
+            if (next <= 0) break;
+            n = next;
         }
-        y++;
     }
 
-    free(row);
-    jpeg_finish_decompress(&cinfo);
+    struct raw_frame_header hdr;
+    struct raw_frame_decoder rf;
+    if (!raw_frame_parse_header(hdr_buf, hdr_sz, &hdr) || !raw_frame_start(tr, conv, &rf, &hdr)) {
+        metrics_inc(METRIC_DECODE_FAILURES, 1);
+        return;
+    }
+    bool ok = true;
+    while (ok) {
+        uint64_t trace_t = trace_begin();
+        ok = raw_frame_decoder_feed(&rf, chunk, n);
+        trace_end("raw frame", trace_t);
+        ssize_t next = stream_wait_chunk(st, &chunk);
+        if (next <= 0) break;
+        n = next;
+    }
+    raw_frame_end(s, tr, &rf, ok, &start);
+}
+
+// Decodes an image while it's being downloaded. Returns false if nothing could be downloaded.
+static bool render_from_stream(struct screen* s, struct transition* tr, struct jpeg_decoder* dec,
+                               const struct gray_conv* conv, struct img_stream* st) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct stream_src src = { .st = st };
+    ssize_t n = stream_wait_chunk(st, &src.first);
+    if (n <= 0) {
+        return false;
+    }
+    src.first_sz = n;
+    printf("Streaming image, first data after %.1f ms\n", ms_since(&start));
+
+    if (raw_frame_sniff(src.first, src.first_sz)) {
+        render_raw_from_stream(s, tr, conv, st, src.first, src.first_sz);
+        printf("Streamed %zu bytes in %.1f ms\n", img_stream_size(st), ms_since(&start));
+        return true;
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_decode_err jerr;
+    cinfo.err = jpeg_decode_err_init(&jerr);
+    jpeg_create_decompress(&cinfo);
+    if (setjmp(jerr.jmp)) {
+        fprintf(stderr, "Failed to decode streamed image\n");
+        metrics_inc(METRIC_DECODE_FAILURES, 1);
+    } else {
+        jpeg_decode_pull_src(&cinfo, stream_next_chunk, &src);
+        render_jpeg_decompress(s, tr, dec, conv, &cinfo);
+    }
     jpeg_destroy_decompress(&cinfo);
+
+    printf("Streamed %zu bytes in %.1f ms\n", img_stream_size(st), ms_since(&start));
+    return true;
+}
+
+
+// Fixed point sine: a full turn is 2^32 phase units, so phases wrap for free and "a * p + delta"
+// is plain integer math. Values are Q14.
+#define SIN_TABLE_BITS 12
+#define SIN_ONE 16384
+#define RAD_TO_PHASE(r) ((uint32_t)(int64_t)((r) * (4294967296.0 / (2 * M_PI))))
+static int16_t sin_table[1 << SIN_TABLE_BITS];
+
+static void sin_table_init(void) {
+    for (int i = 0; i < (1 << SIN_TABLE_BITS); i++) {
+        sin_table[i] = (int16_t)lround(SIN_ONE * sin(2 * M_PI * i / (1 << SIN_TABLE_BITS)));
+    }
 }
 
+static inline int fsin(uint32_t phase) {
+    // Round to the nearest entry
+    phase += 1u << (31 - SIN_TABLE_BITS);
+    return sin_table[phase >> (32 - SIN_TABLE_BITS)];
+}
+
+// Where a frame drew its stamps, so the next frames can erase just those
+struct stamp_list {
+    int n;
+    struct { int16_t x, y; } pts[LISSAJOUS_TRAIL];
+};
+
+static void stamps_erase(struct screen* s, const struct stamp_list* l) {
+    for (int i = 0; i < l->n; i++) {
+        screen_fill_rect(s, l->pts[i].x - 1, l->pts[i].y - 1, 3, 3, 0);
+    }
+}
 
 void render_lissajous(struct screen* s) {
-    struct timespec frame = { .tv_sec = 0, .tv_nsec = 33333333 }; /* ~30fps */
-    double t = 0;
-    while (running) {
-      {
-        int cx = s->width / 2 + (int)(40 * sin(t * 0.5));
-        int cy = s->height / 2;
-        int rx = cx - 20;
-        int ry = cy - 20;
-
-        double a = 3.0, b = 2.0, delta = M_PI * sin(t * 0.8);
-        int trail = 2000;
-
-        screen_clear(s);
-        for (int i = 0; i < trail; i++) {
-            double p = t + (double)i * (2.0 * M_PI / trail);
-            int x = cx + (int)(rx * sin(a * p + delta));
-            int y = cy + (int)(ry * sin(b * p));
-
-            unsigned char brightness = 128 + (unsigned char)(127.0 * i / trail);
-
-            for (int dy = -1; dy <= 1; dy++)
-                for (int dx = -1; dx <= 1; dx++)
-                    screen_set_pixel(s, x + dx, y + dy, brightness);
-        }
+    const long frame_ns = 1000000000L / LISSAJOUS_FPS;
+    // Same speed as the original 0.02 rad per frame at 30 fps
+    const double dt = 0.6 / LISSAJOUS_FPS;
+    const uint32_t dt_phase = RAD_TO_PHASE(dt);
+    const int a = 3, b = 2;
+    const int trail = LISSAJOUS_TRAIL;
+    const uint32_t trail_step = RAD_TO_PHASE(2.0 * M_PI / trail);
+
+    sin_table_init();
+
+    // t, and the slower oscillators at 0.5t (horizontal drift) and 0.8t (phase shift)
+    uint32_t t = 0, t_drift = 0, t_delta = 0;
+
+    // The figure spans most of the screen, so instead of clearing its bounding box erase the stamps
+    // drawn before. With page flipping the back buffer holds the frame from two flips ago, so erase
+    // whatever the last two frames drew. Start from a clean slate in both buffers.
+    static struct stamp_list stamp_bufs[2];
+    struct stamp_list* drawn[2] = { &stamp_bufs[0], &stamp_bufs[1] };
+    drawn[0]->n = drawn[1]->n = 0;
+    screen_clear(s);
+    screen_flip(s);
+    screen_clear(s);
+
+    unsigned frames = 0;
+    long draw_ns_total = 0, draw_ns_max = 0;
+    struct timespec deadline, stats_start;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    stats_start = deadline;
+
+    while (poll_signals()) {
+      struct timespec t0, t1;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+
+      stamps_erase(s, drawn[0]);
+      stamps_erase(s, drawn[1]);
+      // Oldest list is reused for this frame
+      struct stamp_list* stamps = drawn[0];
+      stamps->n = 0;
+
+      int cx = s->width / 2 + 40 * fsin(t_drift) / SIN_ONE;
+      int cy = s->height / 2;
+      int rx = cx - 20;
+      int ry = cy - 20;
+      // delta = pi * sin(0.8t); pi is half a turn, 2^31 phase units. Multiply rather than
+      // shift: fsin is negative half the time, and left shifting a negative value is UB
+      uint32_t delta = (uint32_t)((int64_t)fsin(t_delta) * (1 << (31 - 14)));
+
+      uint32_t p = t;
+      int last_x = INT_MIN, last_y = INT_MIN;
+      unsigned char last_brightness = 0;
+      for (int i = 0; i < trail; i++, p += trail_step) {
+          int x = cx + rx * fsin(a * p + delta) / SIN_ONE;
+          int y = cy + ry * fsin(b * p) / SIN_ONE;
+          unsigned char brightness = 128 + 127 * i / trail;
+
+          // Consecutive points often land on the same pixel; only the last (brightest) one shows
+          if (x != last_x || y != last_y) {
+              if (last_x != INT_MIN) {
+                  screen_fill_rect(s, last_x - 1, last_y - 1, 3, 3, last_brightness);
+                  stamps->pts[stamps->n].x = last_x;
+                  stamps->pts[stamps->n].y = last_y;
+                  stamps->n++;
+              }
+              last_x = x;
+              last_y = y;
+          }
+          last_brightness = brightness;
       }
+      screen_fill_rect(s, last_x - 1, last_y - 1, 3, 3, last_brightness);
+      stamps->pts[stamps->n].x = last_x;
+      stamps->pts[stamps->n].y = last_y;
+      stamps->n++;
+
+      drawn[0] = drawn[1];
+      drawn[1] = stamps;
+
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      long draw_ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+      draw_ns_total += draw_ns;
+      if (draw_ns > draw_ns_max) draw_ns_max = draw_ns;
+      frames++;
 
       screen_flip(s);
-      t += 0.02;
-      nanosleep(&frame, NULL);
+      t += dt_phase;
+      t_drift += dt_phase / 2;
+      t_delta += (uint32_t)(dt_phase * 0.8);
+
+      double stats_elapsed = (t1.tv_sec - stats_start.tv_sec) + (t1.tv_nsec - stats_start.tv_nsec) / 1e9;
+      if (stats_elapsed >= LISSAJOUS_STATS_SEC) {
+          printf("Lissajous: %.1f fps, draw avg %ld us, max %ld us\n",
+                 frames / stats_elapsed, draw_ns_total / frames / 1000, draw_ns_max / 1000);
+          frames = 0;
+          draw_ns_total = draw_ns_max = 0;
+          stats_start = t1;
+      }
+
+      // Absolute deadlines, so time spent drawing doesn't add up as drift. If we fell behind, don't
+      // try to catch up with a burst of frames.
+      deadline.tv_nsec += frame_ns;
+      if (deadline.tv_nsec >= 1000000000L) {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000L;
+      }
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec > deadline.tv_sec ||
+          (now.tv_sec == deadline.tv_sec && now.tv_nsec > deadline.tv_nsec)) {
+          deadline = now;
+      } else {
+          clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+      }
     }
 }
 
-static void render_single_img(struct screen* s, const char* img_path) {
-      render_jpeg(s, img_path, GAMMA);
+static void render_single_img(struct screen* s, struct transition* tr, struct jpeg_decoder* dec,
+                              const struct gray_conv* conv, const char* img_path) {
+      render_jpeg(s, tr, dec, conv, img_path);
       printf("Rendered %s. Press Ctrl-C to exit.\n", img_path);
+      // Nothing else to do: sleep until a signal
+      int epoll_fd = event_loop_new();
+      if (epoll_fd < 0) return;
+      struct epoll_event ev;
       while (running) {
-        screen_flip(s);
-        usleep(16000);
+        wait_events(epoll_fd, &ev, 1);
       }
+      close(epoll_fd);
+}
+
+// Shown while there's no image yet: gray bars, to check the CRT's gamma, and a frame
+static void draw_test_pattern(struct screen* s) {
+    const int bars = 8;
+    screen_clear(s);
+    for (int i = 0; i < bars; i++) {
+        int x0 = s->width * i / bars;
+        int x1 = s->width * (i + 1) / bars;
+        screen_fill_rect(s, x0, s->height / 4, x1 - x0, s->height / 2, 255 * i / (bars - 1));
+    }
+    screen_fill_rect(s, 0, 0, s->width, 2, 255);
+    screen_fill_rect(s, 0, s->height - 2, s->width, 2, 255);
+    screen_fill_rect(s, 0, 0, 2, s->height, 255);
+    screen_fill_rect(s, s->width - 2, 0, 2, s->height, 255);
+    screen_flip(s);
+    log_first_pixel("test pattern");
+}
+
+// Rewrites the metrics file, if there is one. A path that can't be written is reported once and dropped.
+static void write_metrics(void) {
+    if (metrics_path && !metrics_write_prom(metrics_path)) {
+        fprintf(stderr, "Can't write metrics to %s, metrics disabled\n", metrics_path);
+        metrics_path = NULL;
+    }
 }
 
-static void render_img_client(struct screen* s) {
-      struct img_client_ctx* img_render = img_client_init(s->width, s->height, IMG_SERVER_URL);
-      if (img_render) {
-        time_t last_image = 0;  // show first image immediately
-        while (running) {
+// Shows a new image every IMAGE_INTERVAL_SEC. Sleeps in between: wakes up when the next image is due
+// (timer_fd), when an image arrives (img_client's ready fd) and on signals, and does nothing otherwise.
+static void img_client_loop(struct screen* s, struct transition* tr, struct jpeg_decoder* dec,
+                            struct jpeg_stripes* stripes, const struct gray_conv* conv,
+                            struct img_client_ctx* img_render, int epoll_fd, int timer_fd) {
+      const int ready_fd = img_client_get_ready_fd(img_render);
+
+      // Show the first image right away
+      struct timespec next_image;
+      clock_gettime(CLOCK_MONOTONIC, &next_image);
+      arm_timer(timer_fd, &next_image);
+
+      // The next image is due. If there isn't one, stay due until one arrives.
+      bool due = false;
+      // The last image wasn't ready on time
+      bool late = false;
+      bool shown_image = false;
+      time_t last_stream = 0;
+      time_t last_mem_report = time(NULL);
+      time_t last_metrics = 0;
+
+      while (running) {
+        struct epoll_event evs[4];
+        uint64_t trace_t = trace_begin();
+        int n = wait_events(epoll_fd, evs, 4);
+        trace_end("wait", trace_t);
+        for (int i = 0; i < n; i++) {
+          if (evs[i].data.fd == timer_fd) {
+            drain_fd(timer_fd);
+            due = true;
+          } else if (evs[i].data.fd == ready_fd) {
+            drain_fd(ready_fd);
+          }
+        }
+        if (!running) break;
+
+        if (due) {
+          struct timespec started;
+          clock_gettime(CLOCK_MONOTONIC, &started);
           time_t now = time(NULL);
-          if (now - last_image >= IMAGE_INTERVAL_SEC) {
-            const unsigned char* data;
-            size_t sz;
-            if (img_client_get_image(img_render, &data, &sz)) {
-              printf("Rendering image (%zu bytes)\n", sz);
-              render_jpeg_from_mem(s, data, sz, GAMMA);
-              last_image = now;
+          bool shown = false;
+
+          const unsigned char* data;
+          size_t sz;
+          trace_t = trace_begin();
+          bool got_image = img_client_get_image(img_render, &data, &sz);
+          trace_end("get image", trace_t);
+          if (got_image) {
+            printf("Rendering image (%zu bytes)\n", sz);
+            trace_t = trace_begin();
+            render_from_mem(s, tr, dec, stripes, conv, data, sz);
+            trace_end("render image", trace_t);
+            shown = true;
+          } else if (now - last_stream >= IMAGE_INTERVAL_SEC) {
+            // Nothing prefetched (eg first image after startup): don't wait for a full download,
+            // decode while the image arrives. Retry at most once per interval if it fails.
+            struct img_stream* st = img_client_stream_image(img_render);
+            if (st) {
+              last_stream = now;
+              trace_t = trace_begin();
+              shown = render_from_stream(s, tr, dec, conv, st);
+              trace_end("stream image", trace_t);
+            }
+            img_stream_close(st);
+          }
+
+          if (shown) {
+            // Deadlines follow the schedule, so the time to show an image doesn't add up as drift. A
+            // late image restarts the schedule instead, so the next one isn't cut short.
+            if (late) next_image = started;
+            timespec_add_ms(&next_image, IMAGE_INTERVAL_SEC * 1000L);
+            due = late = false;
+            shown_image = true;
+          } else {
+            if (!shown_image && !first_pixel_shown) {
+              // Nothing cached, and the server hasn't answered yet
+              draw_test_pattern(s);
             }
+            // Retry as soon as an image arrives, or after an interval anyway (eg to show a cached
+            // image, or stream one, if the server is down)
+            late = true;
+            next_image = started;
+            timespec_add_ms(&next_image, IMAGE_INTERVAL_SEC * 1000L);
           }
-          screen_flip(s);
-          usleep(50000);
+          arm_timer(timer_fd, &next_image);
+        }
+
+        // Only checked when we wake up anyway, so these never cause a wakeup of their own
+        time_t now = time(NULL);
+        if (now - last_mem_report >= MEM_REPORT_SEC) {
+          mem_budget_report();
+          last_mem_report = now;
+        }
+        if (now - last_metrics >= METRICS_SEC) {
+          write_metrics();
+          last_metrics = now;
         }
-        img_client_free(img_render);
       }
 }
 
+// Where to keep the image cache, see IMG_CACHE_MAX_MB. NULL if there's no cache, or nowhere to put it.
+static const char* img_cache_dir(char* buf, size_t buf_sz) {
+    if (IMG_CACHE_MAX_MB == 0) {
+        return NULL;
+    }
+    const char* dir = getenv("PICRT_CACHE_DIR");
+    if (dir && dir[0]) {
+        return dir;
+    }
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    int n;
+    if (xdg && xdg[0]) {
+        n = snprintf(buf, buf_sz, "%s/picrt", xdg);
+    } else if (home && home[0]) {
+        n = snprintf(buf, buf_sz, "%s/.cache/picrt", home);
+    } else {
+        fprintf(stderr, "Neither PICRT_CACHE_DIR nor HOME are set, image cache disabled\n");
+        return NULL;
+    }
+    if (n < 0 || (size_t)n >= buf_sz) {
+        fprintf(stderr, "Image cache path too long, image cache disabled\n");
+        return NULL;
+    }
+    return buf;
+}
+
+static void render_img_client(struct screen* s, struct transition* tr, struct jpeg_decoder* dec,
+                              struct jpeg_stripes* stripes, const struct gray_conv* conv) {
+      char cache_dir[PATH_MAX];
+      // Doesn't block: registration happens in the background, and meanwhile we get cached images
+      const struct img_client_cfg cfg = {
+        .server_url = IMG_SERVER_URL,
+        .screen_w = s->width,
+        .screen_h = s->height,
+        .image_interval_sec = IMAGE_INTERVAL_SEC,
+        .prefetch_max_bytes = PREFETCH_MAX_MB * 1024 * 1024,
+        .cache_dir = img_cache_dir(cache_dir, sizeof(cache_dir)),
+        .cache_max_bytes = IMG_CACHE_MAX_MB * 1024 * 1024,
+        .raw_format = IMG_RAW_FORMAT,
+        .raw_compression = IMG_RAW_COMPRESSION,
+        .raw_gamma = GAMMA,
+        .hedge_downloads = PREFETCH_HEDGE,
+      };
+      struct img_client_ctx* img_render = img_client_init(&cfg);
+      if (!img_render) {
+        return;
+      }
+
+      int epoll_fd = event_loop_new();
+      int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (timer_fd < 0) {
+        perror("timerfd_create");
+      } else if (epoll_fd >= 0 && epoll_watch(epoll_fd, timer_fd) &&
+                 epoll_watch(epoll_fd, img_client_get_ready_fd(img_render))) {
+        img_client_loop(s, tr, dec, stripes, conv, img_render, epoll_fd, timer_fd);
+      }
+      if (timer_fd >= 0) close(timer_fd);
+      if (epoll_fd >= 0) close(epoll_fd);
+
+      img_client_free(img_render);
+      write_metrics();
+}
+
 int main(int argc, char* argv[]) {
-    signal(SIGINT, sighandler);
-    signal(SIGTERM, sighandler);
-    signal(SIGHUP, sighandler);
+    clock_gettime(CLOCK_MONOTONIC, &startup_time);
+    trace_path = getenv("PICRT_TRACE");
+    metrics_path = getenv("PICRT_METRICS");
+    if (metrics_path && !metrics_path[0]) metrics_path = NULL;
     // Monitor when parent is killed, so we can run over ssh and exit when session closes
     prctl(PR_SET_PDEATHSIG, SIGTERM);
 
+    char run_mode = 's';
+    if (argc > 1 && argv[1][0] == '-') {
+      run_mode = argv[1][1];
+    }
+
+    mem_budget_init((size_t)MEM_BUDGET_MB * 1024 * 1024);
+
+    if (trace_path) {
+      trace_init(TRACE_RING_EVENTS);
+      trace_thread_name("render");
+    }
+
+    struct gray_conv conv;
+    gray_conv_init(&conv, GAMMA);
+
+    if (run_mode == 'b') {
+      gray_conv_bench(GAMMA, 720);
+      if (argc > 2) {
+        jpeg_decode_bench(argv[2], 720, 576, &conv);
+      }
+      return 0;
+    }
+
+    // Not for benchmarks: they never read signal_fd, so blocked signals couldn't stop them. Must run
+    // before any thread starts.
+    setup_signals(trace_path != NULL);
+
+    struct jpeg_decoder dec;
+    jpeg_decoder_init(&dec, JPEG_PROFILE);
+
     struct screen* s = screen_new();
     if (s == NULL) {
       return 1;
     }
 
-    char run_mode = 's';
-    if (argc > 1 && argv[1][0] == '-') {
-      run_mode = argv[1][1];
+    // Optional: everything works in this thread without it
+    struct worker_pool* pool = worker_pool_new(WORKER_THREADS);
+    printf("Worker pool: %d threads\n", worker_pool_threads(pool));
+    struct jpeg_stripes* stripes = NULL;
+    if (worker_pool_threads(pool) > 1) {
+      stripes = jpeg_stripes_new(pool, JPEG_PROFILE, &conv);
+    }
+
+    struct transition tr;
+    if (!transition_init(&tr, s->width, s->height, TRANSITION_EFFECT, TRANSITION_MS, TRANSITION_FPS,
+                         pool)) {
+      jpeg_stripes_free(stripes);
+      worker_pool_free(pool);
+      screen_free(s);
+      return 1;
     }
 
     if (run_mode == 's') {
-      render_img_client(s);
+      render_img_client(s, &tr, &dec, stripes, &conv);
     } else if (run_mode == 'l') {
       render_lissajous(s);
     } else if (run_mode == 'f' && argc > 2) {
-      render_single_img(s, argv[2]);
+      render_single_img(s, &tr, &dec, &conv, argv[2]);
     } else {
-      printf("%s [-s|-l|-f file] - Do something with a CRT\n", argv[0]);
+      printf("%s [-s|-l|-f file|-b [file]] - Do something with a CRT\n", argv[0]);
       printf("  -s  Display from image server\n");
       printf("  -f  Display a picture. Provide path after -f.\n");
       printf("  -l  Render a Lissajous figure so your CRT looks sciency\n");
+      printf("  -b  Benchmark pixel conversion. If a picture is given, also benchmark decoding it.\n");
       printf("  -h  Help\n");
     }
 
+    transition_free(&tr);
+    jpeg_stripes_free(stripes);
+    worker_pool_free(pool);
     screen_free(s);
+    jpeg_decoder_free(&dec);
+    mem_budget_report();
+    if (trace_path) trace_dump(trace_path);
+    if (signal_fd >= 0) close(signal_fd);
     printf("\nClean exit.\n");
     return 0;
 }
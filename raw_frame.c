@@ -0,0 +1,200 @@
+#include "raw_frame.h"
+#include "gray_conv.h"
+#include "mem_budget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Anything bigger than this is not meant for a CRT
+#define RAW_FRAME_MAX_DIM 4096
+// inflate's state plus its 32 KB window
+#define RAW_FRAME_INFLATE_MEM (40 * 1024)
+
+static const unsigned char magic[4] = {'P', 'R', 'A', 'W'};
+
+const char* raw_frame_format_name(enum raw_frame_format f) {
+    switch (f) {
+    case RAW_FRAME_NONE: return "jpeg";
+    case RAW_FRAME_GRAY8: return "gray8";
+    case RAW_FRAME_RGB565: return "rgb565";
+    }
+    return "?";
+}
+
+const char* raw_frame_compression_name(enum raw_frame_compression c) {
+    switch (c) {
+    case RAW_FRAME_UNCOMPRESSED: return "none";
+    case RAW_FRAME_DEFLATE: return "deflate";
+    }
+    return "?";
+}
+
+bool raw_frame_sniff(const unsigned char* data, size_t sz) {
+    return sz >= sizeof(magic) && memcmp(data, magic, sizeof(magic)) == 0;
+}
+
+static unsigned read_u16(const unsigned char* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_u32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static size_t bytes_per_px(enum raw_frame_format f) {
+    return f == RAW_FRAME_RGB565 ? 2 : 1;
+}
+
+bool raw_frame_parse_header(const unsigned char* data, size_t sz, struct raw_frame_header* hdr) {
+    if (!raw_frame_sniff(data, sz)) {
+        return false;
+    }
+    if (sz < RAW_FRAME_HEADER_SZ) {
+        fprintf(stderr, "Truncated raw frame header, %zu bytes\n", sz);
+        return false;
+    }
+    if (data[4] != RAW_FRAME_VERSION) {
+        fprintf(stderr, "Unsupported raw frame version %d\n", data[4]);
+        return false;
+    }
+    if (data[5] != RAW_FRAME_GRAY8 && data[5] != RAW_FRAME_RGB565) {
+        fprintf(stderr, "Unsupported raw frame format %d\n", data[5]);
+        return false;
+    }
+    if (data[6] != RAW_FRAME_UNCOMPRESSED && data[6] != RAW_FRAME_DEFLATE) {
+        fprintf(stderr, "Unsupported raw frame compression %d\n", data[6]);
+        return false;
+    }
+
+    hdr->format = data[5];
+    hdr->compression = data[6];
+    hdr->width = read_u16(data + 8);
+    hdr->height = read_u16(data + 10);
+    hdr->payload_sz = read_u32(data + 12);
+    if (hdr->width == 0 || hdr->height == 0 ||
+        hdr->width > RAW_FRAME_MAX_DIM || hdr->height > RAW_FRAME_MAX_DIM) {
+        fprintf(stderr, "Bad raw frame size %dx%d\n", hdr->width, hdr->height);
+        return false;
+    }
+    const size_t pixels_sz = bytes_per_px(hdr->format) * hdr->width * hdr->height;
+    if (hdr->compression == RAW_FRAME_UNCOMPRESSED && hdr->payload_sz != pixels_sz) {
+        fprintf(stderr, "Bad raw frame: %zu bytes of pixels for %dx%d %s\n",
+                hdr->payload_sz, hdr->width, hdr->height, raw_frame_format_name(hdr->format));
+        return false;
+    }
+    return true;
+}
+
+static size_t decoder_mem(const struct raw_frame_decoder* d) {
+    return d->row_bytes + (d->inflating ? RAW_FRAME_INFLATE_MEM : 0);
+}
+
+bool raw_frame_decoder_start(struct raw_frame_decoder* d, const struct raw_frame_header* hdr,
+                             const struct gray_conv* conv, unsigned char* dst, int dst_w, int dst_h) {
+    memset(d, 0, sizeof(*d));
+    d->hdr = *hdr;
+    d->conv = conv;
+    d->dst = dst;
+    d->dst_w = dst_w;
+    d->dst_h = dst_h;
+    d->row_bytes = bytes_per_px(hdr->format) * hdr->width;
+    d->inflating = hdr->compression == RAW_FRAME_DEFLATE;
+
+    // Same placement as JPEGs: crop around the center
+    d->crop_x = hdr->width > dst_w ? (hdr->width - dst_w) / 2 : 0;
+    d->crop_y = hdr->height > dst_h ? (hdr->height - dst_h) / 2 : 0;
+    d->visible_w = hdr->width - d->crop_x < dst_w ? hdr->width - d->crop_x : dst_w;
+    d->visible_h = hdr->height - d->crop_y < dst_h ? hdr->height - d->crop_y : dst_h;
+
+    if (!mem_budget_reserve(MEM_DECODER, decoder_mem(d))) {
+        fprintf(stderr, "Can't decode %dx%d raw frame, doesn't fit in memory budget\n",
+                hdr->width, hdr->height);
+        return false;
+    }
+    d->row = malloc(d->row_bytes);
+    if (!d->row) {
+        fprintf(stderr, "bad alloc, can't decode %dx%d raw frame\n", hdr->width, hdr->height);
+        mem_budget_release(MEM_DECODER, decoder_mem(d));
+        return false;
+    }
+    if (d->inflating && inflateInit(&d->zs) != Z_OK) {
+        fprintf(stderr, "Can't decode raw frame: %s\n", d->zs.msg ? d->zs.msg : "inflateInit failed");
+        free(d->row);
+        mem_budget_release(MEM_DECODER, decoder_mem(d));
+        return false;
+    }
+    return true;
+}
+
+// Where the current row should be assembled. gray8 rows that fit the screen's width go straight to
+// dst, the rest need cropping or conversion.
+static unsigned char* row_target(struct raw_frame_decoder* d) {
+    const int sy = d->y - d->crop_y;
+    if (d->hdr.format == RAW_FRAME_GRAY8 && d->hdr.width == d->dst_w && sy >= 0 && sy < d->visible_h) {
+        return d->dst + (size_t)sy * d->dst_w;
+    }
+    return d->row;
+}
+
+static void emit_row(struct raw_frame_decoder* d, const unsigned char* row) {
+    const int sy = d->y - d->crop_y;
+    if (row != d->row || sy < 0 || sy >= d->visible_h) {
+        return;
+    }
+    unsigned char* dst = d->dst + (size_t)sy * d->dst_w;
+    if (d->hdr.format == RAW_FRAME_GRAY8) {
+        memcpy(dst, row + d->crop_x, d->visible_w);
+    } else {
+        gray_conv_row_rgb565(d->conv, row + 2 * d->crop_x, dst, d->visible_w);
+    }
+}
+
+bool raw_frame_decoder_feed(struct raw_frame_decoder* d, const unsigned char* data, size_t sz) {
+    while (sz > 0 && d->y < d->hdr.height && !d->stream_end) {
+        unsigned char* out = row_target(d);
+        const size_t want = d->row_bytes - d->row_fill;
+        if (!d->inflating) {
+            const size_t n = sz < want ? sz : want;
+            memcpy(out + d->row_fill, data, n);
+            data += n;
+            sz -= n;
+            d->row_fill += n;
+        } else {
+            d->zs.next_in = (Bytef*)data;
+            d->zs.avail_in = sz;
+            d->zs.next_out = out + d->row_fill;
+            d->zs.avail_out = want;
+            const int ret = inflate(&d->zs, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                fprintf(stderr, "Bad raw frame: %s\n", d->zs.msg ? d->zs.msg : "can't inflate");
+                return false;
+            }
+            data += sz - d->zs.avail_in;
+            sz = d->zs.avail_in;
+            d->row_fill += want - d->zs.avail_out;
+            d->stream_end = ret == Z_STREAM_END;
+        }
+
+        if (d->row_fill == d->row_bytes) {
+            emit_row(d, out);
+            d->row_fill = 0;
+            d->y++;
+        }
+    }
+    return true;
+}
+
+bool raw_frame_decoder_finish(struct raw_frame_decoder* d) {
+    if (d->inflating) {
+        inflateEnd(&d->zs);
+    }
+    free(d->row);
+    mem_budget_release(MEM_DECODER, decoder_mem(d));
+    d->row = NULL;
+    if (d->y < d->hdr.height) {
+        fprintf(stderr, "Truncated raw frame: %d of %d rows\n", d->y, d->hdr.height);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+struct gray_conv;
+
+/**
+ * Frames the image server can send instead of a JPEG, already sized for the
+ * screen, so showing one takes no decoding: rows are copied (or inflated)
+ * straight into place. A frame is a 16 byte header followed by height rows of
+ * pixels, optionally deflated as a single zlib stream:
+ *
+ *   0  "PRAW"
+ *   4  u8  version, RAW_FRAME_VERSION
+ *   5  u8  enum raw_frame_format
+ *   6  u8  enum raw_frame_compression
+ *   7  u8  reserved, 0
+ *   8  u16 width, little endian
+ *   10 u16 height, little endian
+ *   12 u32 payload bytes after the header, little endian
+ *
+ * gray8 pixels are final: the server already applied the gamma the client
+ * asked for. rgb565 pixels (little endian) are converted to gray by the
+ * client, like JPEGs are. Frames bigger than the screen are cropped around
+ * the center, smaller ones are drawn at the top left.
+ */
+#define RAW_FRAME_HEADER_SZ 16
+#define RAW_FRAME_VERSION 1
+
+enum raw_frame_format {
+    RAW_FRAME_NONE,    // Not a raw frame; for configs, means JPEG
+    RAW_FRAME_GRAY8,
+    RAW_FRAME_RGB565,
+};
+
+enum raw_frame_compression {
+    RAW_FRAME_UNCOMPRESSED,
+    RAW_FRAME_DEFLATE,
+};
+
+struct raw_frame_header {
+    enum raw_frame_format format;
+    enum raw_frame_compression compression;
+    int width;
+    int height;
+    size_t payload_sz;
+};
+
+const char* raw_frame_format_name(enum raw_frame_format f);
+const char* raw_frame_compression_name(enum raw_frame_compression c);
+
+// True if data (sz bytes of it, can be less than a header) starts like a raw frame
+bool raw_frame_sniff(const unsigned char* data, size_t sz);
+
+/**
+ * Parses the header at the start of data. Returns false if it's not a raw
+ * frame, or not one this client can show.
+ */
+bool raw_frame_parse_header(const unsigned char* data, size_t sz, struct raw_frame_header* hdr);
+
+/**
+ * Writes a frame's pixels into dst, a dst_w x dst_h gray8 buffer, as its
+ * payload arrives. Rows of dst that the frame doesn't cover are left as is.
+ */
+struct raw_frame_decoder {
+    struct raw_frame_header hdr;
+    const struct gray_conv* conv;
+    unsigned char* dst;
+    int dst_w;
+    int dst_h;
+    // Part of the frame that ends up in dst
+    int crop_x;
+    int crop_y;
+    int visible_w;
+    int visible_h;
+    // Rows are assembled here, unless they can go straight to dst
+    unsigned char* row;
+    size_t row_bytes;
+    size_t row_fill;
+    int y;
+    z_stream zs;
+    bool inflating;
+    bool stream_end;
+};
+
+// Returns false on bad alloc, or if the decoder doesn't fit in the memory budget
+bool raw_frame_decoder_start(struct raw_frame_decoder* d, const struct raw_frame_header* hdr,
+                             const struct gray_conv* conv, unsigned char* dst, int dst_w, int dst_h);
+
+// Decodes the next sz bytes of payload. Returns false if the payload is corrupt.
+bool raw_frame_decoder_feed(struct raw_frame_decoder* d, const unsigned char* data, size_t sz);
+
+// Frees the decoder. Returns true if all rows of the frame were decoded.
+bool raw_frame_decoder_finish(struct raw_frame_decoder* d);
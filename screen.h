@@ -1,5 +1,13 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
+// Writes n gray values to a row of framebuffer memory, in the screen's pixel format
+typedef void (*screen_span_writer)(unsigned char *dst, const unsigned char *gray, int n);
+// Fills n pixels of framebuffer memory with a single gray value
+typedef void (*screen_span_filler)(unsigned char *dst, unsigned char val, int n);
+
 struct screen {
   void *impl;
   unsigned char *fb;
@@ -7,10 +15,33 @@ struct screen {
   int height;
   int bpp;
   int stride;
+  // Set by drawing calls, cleared when the back buffer is presented. Code writing to fb directly
+  // must set it, or screen_flip may skip presenting the frame.
+  bool dirty;
+  // Specialized for bpp by screen_init_writers, when the backend is created
+  screen_span_writer write_span;
+  screen_span_filler fill_span;
+  // Pixels written through the span API and transitions, for stats. Only touched by the render thread.
+  size_t px_written;
 };
 
 struct screen* screen_new(void);
 void screen_free(struct screen* s);
 void screen_set_pixel(struct screen* s, int x, int y, unsigned char val);
+// Presents the back buffer (s->fb). Backends may page flip, so after this call fb may point to a
+// buffer holding an older frame: callers that don't redraw everything should clear it first.
+// No-op if nothing was drawn since the last flip.
 void screen_flip(struct screen* s);
+// Makes rows [y, y+n) of the back buffer visible, without swapping buffers. Meant for progressive
+// reveals, where flipping every row would be wasteful.
+void screen_present_rows(struct screen* s, int y, int n);
 void screen_clear(struct screen* s);
+
+// Span API, shared by all backends (screen_span.c). Coordinates are clipped once per call.
+
+// Picks the span writers for s->bpp. Returns false if the pixel format is not supported.
+bool screen_init_writers(struct screen* s);
+// Writes n gray8 values starting at (x, y)
+void screen_write_row(struct screen* s, int x, int y, const unsigned char* gray, int n);
+// Fills a w*h rectangle with a gray value
+void screen_fill_rect(struct screen* s, int x, int y, int w, int h, unsigned char val);
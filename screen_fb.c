@@ -1,4 +1,5 @@
 #include "screen.h"
+#include "trace.h"
 
 #include <fcntl.h>
 #include <linux/fb.h>
@@ -11,21 +12,51 @@
 
 struct fb_impl {
   int fd;
+  // Mode before we touched it, restored on exit
+  struct fb_var_screeninfo orig_vinfo;
+  struct fb_var_screeninfo vinfo;
+  // Whole mapped framebuffer memory. With page flipping it holds two pages.
+  unsigned char *map;
+  size_t map_sz;
+  size_t page_sz;
+  // Page flipping: index of the page being scanned out. Otherwise s->fb is a shadow
+  // buffer that gets copied to the visible one on flip.
+  bool page_flip;
+  int front;
+  bool can_wait_vsync;
 };
 
-void screen_free(struct screen* s) {
-  if (s == NULL) return;
+static unsigned char* front_buffer(struct screen* s) {
   struct fb_impl *impl = s->impl;
+  return impl->map + (impl->page_flip ? impl->front * impl->page_sz : 0);
+}
 
-  if (s->fb != MAP_FAILED && impl != NULL && impl->fd > 0) {
-    screen_clear(s);
+static void wait_vsync(struct fb_impl* impl) {
+  if (!impl->can_wait_vsync) return;
+  uint64_t trace_t = trace_begin();
+  unsigned int crtc = 0;
+  if (ioctl(impl->fd, FBIO_WAITFORVSYNC, &crtc) < 0) {
+    perror("FBIO_WAITFORVSYNC, flips won't be vsync locked");
+    impl->can_wait_vsync = false;
   }
+  trace_end("vsync", trace_t);
+}
+
+void screen_free(struct screen* s) {
+  if (s == NULL) return;
+  struct fb_impl *impl = s->impl;
 
-  if (s->fb != MAP_FAILED) {
-    munmap(s->fb, s->stride * s->height);
+  if (impl && impl->map != MAP_FAILED) {
+    memset(impl->map, 0, impl->map_sz);
+    munmap(impl->map, impl->map_sz);
   }
 
   if (impl) {
+    if (impl->page_flip) {
+      ioctl(impl->fd, FBIOPUT_VSCREENINFO, &impl->orig_vinfo);
+    } else if (s->fb != MAP_FAILED) {
+      free(s->fb);
+    }
     if (impl->fd > 0) {
       close(impl->fd);
     }
@@ -35,14 +66,50 @@ void screen_free(struct screen* s) {
   free(s);
 }
 
+// Ask the driver for a virtual screen twice as tall as the visible one, so we can draw one page
+// while the other one is scanned out. Returns false if the driver can't do it.
+static bool setup_page_flip(struct screen* s, struct fb_fix_screeninfo* finfo) {
+  struct fb_impl *impl = s->impl;
+  struct fb_var_screeninfo v = impl->vinfo;
+  v.yres_virtual = v.yres * 2;
+  v.yoffset = 0;
+  if (ioctl(impl->fd, FBIOPUT_VSCREENINFO, &v) < 0 ||
+      ioctl(impl->fd, FBIOGET_VSCREENINFO, &v) < 0 ||
+      ioctl(impl->fd, FBIOGET_FSCREENINFO, finfo) < 0) {
+    return false;
+  }
+
+  if (v.yres_virtual < v.yres * 2 || finfo->smem_len < finfo->line_length * v.yres * 2) {
+    ioctl(impl->fd, FBIOPUT_VSCREENINFO, &impl->orig_vinfo);
+    ioctl(impl->fd, FBIOGET_FSCREENINFO, finfo);
+    return false;
+  }
+
+  // Check panning actually works before relying on it
+  v.yoffset = 0;
+  if (ioctl(impl->fd, FBIOPAN_DISPLAY, &v) < 0) {
+    ioctl(impl->fd, FBIOPUT_VSCREENINFO, &impl->orig_vinfo);
+    ioctl(impl->fd, FBIOGET_FSCREENINFO, finfo);
+    return false;
+  }
+
+  impl->vinfo = v;
+  return true;
+}
+
 struct screen* screen_new(void) {
     struct screen *s = malloc(sizeof(struct screen));
     if (!s) return NULL;
     s->fb = MAP_FAILED;
+    s->dirty = false;
 
     struct fb_impl* impl = malloc(sizeof(struct fb_impl));
     s->impl = impl;
     if (!impl) { screen_free(s); return NULL; }
+    impl->map = MAP_FAILED;
+    impl->page_flip = false;
+    impl->front = 0;
+    impl->can_wait_vsync = true;
 
     impl->fd = open("/dev/fb0", O_RDWR);
     if (impl->fd < 0) {
@@ -51,34 +118,55 @@ struct screen* screen_new(void) {
         return NULL;
     }
 
-    struct fb_var_screeninfo vinfo;
     struct fb_fix_screeninfo finfo;
     if (ioctl(impl->fd, FBIOGET_FSCREENINFO, &finfo) < 0 ||
-        ioctl(impl->fd, FBIOGET_VSCREENINFO, &vinfo) < 0) {
+        ioctl(impl->fd, FBIOGET_VSCREENINFO, &impl->vinfo) < 0) {
         perror("ioctl");
         screen_free(s);
         return NULL;
     }
+    impl->orig_vinfo = impl->vinfo;
+    impl->page_flip = setup_page_flip(s, &finfo);
 
-    s->width = vinfo.xres;
-    s->height = vinfo.yres;
-    s->bpp = vinfo.bits_per_pixel;
+    s->width = impl->vinfo.xres;
+    s->height = impl->vinfo.yres;
+    s->bpp = impl->vinfo.bits_per_pixel;
     s->stride = finfo.line_length;
+    if (!screen_init_writers(s)) {
+        screen_free(s);
+        return NULL;
+    }
 
-    size_t size = s->stride * s->height;
-    s->fb = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, impl->fd, 0);
-    if (s->fb == MAP_FAILED) {
+    impl->page_sz = (size_t)s->stride * s->height;
+    impl->map_sz = impl->page_sz * (impl->page_flip ? 2 : 1);
+    impl->map = mmap(NULL, impl->map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, impl->fd, 0);
+    if (impl->map == MAP_FAILED) {
         perror("mmap");
         screen_free(s);
         return NULL;
     }
 
-    printf("Screen: %dx%d, %d bpp, stride %d\n", s->width, s->height, s->bpp, s->stride);
+    if (impl->page_flip) {
+        // Draw into the page that isn't being displayed
+        s->fb = impl->map + impl->page_sz;
+    } else {
+        s->fb = calloc(1, impl->page_sz);
+        if (!s->fb) {
+            s->fb = MAP_FAILED;
+            fprintf(stderr, "bad alloc, can't create shadow framebuffer\n");
+            screen_free(s);
+            return NULL;
+        }
+    }
+
+    printf("Screen: %dx%d, %d bpp, stride %d, %s\n", s->width, s->height, s->bpp, s->stride,
+           impl->page_flip ? "double buffered" : "shadow buffered");
     return s;
 }
 
 void screen_set_pixel(struct screen* s, int x, int y, unsigned char val) {
     if (x < 0 || x >= s->width || y < 0 || y >= s->height) return;
+    s->dirty = true;
     if (s->bpp == 32) {
         unsigned char *px = s->fb + y * s->stride + x * 4;
         px[0] = val; px[1] = val; px[2] = val; px[3] = 0xFF;
@@ -90,9 +178,42 @@ void screen_set_pixel(struct screen* s, int x, int y, unsigned char val) {
 }
 
 void screen_flip(struct screen* s) {
-    (void)s;
+    struct fb_impl *impl = s->impl;
+    if (!s->dirty) return;
+    s->dirty = false;
+
+    if (!impl->page_flip) {
+        wait_vsync(impl);
+        uint64_t trace_t = trace_begin();
+        memcpy(impl->map, s->fb, impl->page_sz);
+        trace_end("fb copy", trace_t);
+        return;
+    }
+
+    int back = !impl->front;
+    impl->vinfo.yoffset = back * s->height;
+    uint64_t trace_t = trace_begin();
+    if (ioctl(impl->fd, FBIOPAN_DISPLAY, &impl->vinfo) < 0) {
+        perror("FBIOPAN_DISPLAY");
+        return;
+    }
+    trace_end("fb pan", trace_t);
+    // Pan takes effect on the next vblank; wait for it so we don't draw on a page being scanned
+    wait_vsync(impl);
+    impl->front = back;
+    s->fb = impl->map + !back * impl->page_sz;
+}
+
+void screen_present_rows(struct screen* s, int y, int n) {
+    if (y < 0) { n += y; y = 0; }
+    if (y + n > s->height) n = s->height - y;
+    if (n <= 0) return;
+    uint64_t trace_t = trace_begin();
+    memcpy(front_buffer(s) + y * s->stride, s->fb + y * s->stride, (size_t)n * s->stride);
+    trace_end("present rows", trace_t);
 }
 
 void screen_clear(struct screen* s) {
     memset(s->fb, 0, s->stride * s->height);
+    s->dirty = true;
 }
@@ -0,0 +1,167 @@
+#include "screen_mem.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct mem_impl {
+  struct screen_mem_stats stats;
+  // Set for screens created through screen_new, which print their stats on exit
+  bool report;
+  char *snapshot_path;
+};
+
+void screen_free(struct screen *s) {
+  if (s == NULL) return;
+  struct mem_impl *impl = s->impl;
+
+  if (impl) {
+    if (impl->snapshot_path && s->fb) {
+      screen_mem_snapshot(s, impl->snapshot_path);
+    }
+    if (impl->report) {
+      printf("screen (mem): %zu flips, %zu row presents, %zu px written\n",
+             impl->stats.flips, impl->stats.present_rows, s->px_written);
+    }
+    free(impl->snapshot_path);
+    free(impl);
+  }
+
+  free(s->fb);
+  free(s);
+}
+
+struct screen* screen_mem_new(int width, int height, int bpp) {
+  if (width <= 0 || height <= 0) {
+    fprintf(stderr, "Invalid headless screen size %dx%d\n", width, height);
+    return NULL;
+  }
+
+  struct screen *s = calloc(1, sizeof(struct screen));
+  if (!s) return NULL;
+  struct mem_impl *impl = calloc(1, sizeof(struct mem_impl));
+  s->impl = impl;
+  if (!impl) { screen_free(s); return NULL; }
+
+  s->width = width;
+  s->height = height;
+  s->bpp = bpp;
+  s->stride = width * (bpp / 8);
+  if (!screen_init_writers(s)) {
+    screen_free(s);
+    return NULL;
+  }
+
+  s->fb = calloc(1, (size_t)s->stride * s->height);
+  if (!s->fb) {
+    fprintf(stderr, "bad alloc, can't create headless screen\n");
+    screen_free(s);
+    return NULL;
+  }
+
+  return s;
+}
+
+struct screen* screen_new(void) {
+  int w = 720, h = 576, bpp = 32;
+  const char *cfg = getenv("PICRT_SCREEN");
+  if (cfg && sscanf(cfg, "%dx%dx%d", &w, &h, &bpp) != 3) {
+    fprintf(stderr, "Bad PICRT_SCREEN '%s', expected WxHxBPP\n", cfg);
+    return NULL;
+  }
+
+  struct screen *s = screen_mem_new(w, h, bpp);
+  if (!s) return NULL;
+
+  struct mem_impl *impl = s->impl;
+  impl->report = true;
+  const char *snap = getenv("PICRT_SNAPSHOT");
+  if (snap) {
+    impl->snapshot_path = strdup(snap);
+  }
+
+  printf("screen (mem): %dx%d, %d bpp, stride %d\n", s->width, s->height, s->bpp, s->stride);
+  return s;
+}
+
+void screen_set_pixel(struct screen *s, int x, int y, unsigned char val) {
+  if (x < 0 || x >= s->width || y < 0 || y >= s->height) return;
+  s->write_span(s->fb + y * s->stride + x * (s->bpp / 8), &val, 1);
+  s->px_written++;
+  s->dirty = true;
+}
+
+void screen_flip(struct screen *s) {
+  if (!s->dirty) return;
+  struct mem_impl *impl = s->impl;
+  impl->stats.flips++;
+  s->dirty = false;
+}
+
+void screen_present_rows(struct screen *s, int y, int n) {
+  (void)y;
+  (void)n;
+  struct mem_impl *impl = s->impl;
+  impl->stats.present_rows++;
+}
+
+void screen_clear(struct screen *s) {
+  memset(s->fb, 0, s->stride * s->height);
+  s->dirty = true;
+}
+
+void screen_mem_get_stats(const struct screen *s, struct screen_mem_stats *out) {
+  const struct mem_impl *impl = s->impl;
+  *out = impl->stats;
+  out->px_written = s->px_written;
+}
+
+void screen_mem_reset_stats(struct screen *s) {
+  struct mem_impl *impl = s->impl;
+  memset(&impl->stats, 0, sizeof(impl->stats));
+  s->px_written = 0;
+}
+
+static void read_rgb(const struct screen *s, int x, int y, unsigned char rgb[3]) {
+  const unsigned char *row = s->fb + y * s->stride;
+  if (s->bpp == 32) {
+    const unsigned char *px = row + x * 4;
+    rgb[0] = px[2]; rgb[1] = px[1]; rgb[2] = px[0];
+  } else {
+    uint16_t px = ((const uint16_t *)row)[x];
+    rgb[0] = ((px >> 11) & 0x1F) << 3;
+    rgb[1] = ((px >> 5) & 0x3F) << 2;
+    rgb[2] = (px & 0x1F) << 3;
+  }
+}
+
+bool screen_mem_snapshot(const struct screen *s, const char *path) {
+  size_t len = strlen(path);
+  bool color = len >= 4 && strcmp(path + len - 4, ".ppm") == 0;
+
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+
+  fprintf(f, "P%d\n%d %d\n255\n", color ? 6 : 5, s->width, s->height);
+  for (int y = 0; y < s->height; y++) {
+    for (int x = 0; x < s->width; x++) {
+      unsigned char rgb[3];
+      read_rgb(s, x, y, rgb);
+      if (color) {
+        fwrite(rgb, 1, 3, f);
+      } else {
+        // Everything picrt draws is gray, green has the most precision in RGB565
+        fputc(rgb[1], f);
+      }
+    }
+  }
+
+  bool ok = !ferror(f);
+  if (fclose(f) != 0) ok = false;
+  if (!ok) fprintf(stderr, "Failed to write snapshot %s\n", path);
+  return ok;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "screen.h"
+
+/**
+ * Headless screen backend (screen_mem.c): renders to a plain memory buffer, so the render paths
+ * can run without a display, eg under perf or valgrind. screen_new reads its config from the
+ * environment:
+ *   PICRT_SCREEN=WxHxBPP   Resolution and pixel format, default 720x576x32. bpp is 16 or 32.
+ *   PICRT_SNAPSHOT=path    Dump the last frame on exit. A .ppm path writes color, anything else
+ *                          a gray .pgm.
+ */
+
+struct screen_mem_stats {
+  size_t flips;
+  size_t present_rows;
+  size_t px_written;
+};
+
+struct screen* screen_mem_new(int width, int height, int bpp);
+
+// px_written counts what goes through the span API (see screen.h), not direct writes to fb
+void screen_mem_get_stats(const struct screen* s, struct screen_mem_stats* out);
+void screen_mem_reset_stats(struct screen* s);
+
+// Writes the back buffer as PPM (if path ends in .ppm) or PGM. Returns false on failure.
+bool screen_mem_snapshot(const struct screen* s, const char* path);
@@ -1,4 +1,5 @@
 #include "screen.h"
+#include "trace.h"
 
 #include <SDL2/SDL.h>
 #include <signal.h>
@@ -46,6 +47,8 @@ struct screen *screen_new(void) {
   s->height = 576;
   s->bpp = 32;
   s->stride = s->width * 4;
+  s->dirty = false;
+  screen_init_writers(s);
 
   impl->window = SDL_CreateWindow("picrt", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
                                   s->width, s->height, 0);
@@ -79,15 +82,16 @@ struct screen *screen_new(void) {
 
 void screen_set_pixel(struct screen *s, int x, int y, unsigned char val) {
   if (x < 0 || x >= s->width || y < 0 || y >= s->height) return;
+  s->dirty = true;
   unsigned char *px = s->fb + y * s->stride + x * 4;
   px[0] = val; px[1] = val; px[2] = val; px[3] = 0xFF;
 }
 
-void screen_flip(struct screen *s) {
-  struct sdl_impl *impl = s->impl;
-  SDL_UpdateTexture(impl->texture, NULL, s->fb, s->stride);
+static void present(struct sdl_impl *impl) {
+  uint64_t trace_t = trace_begin();
   SDL_RenderCopy(impl->renderer, impl->texture, NULL, NULL);
   SDL_RenderPresent(impl->renderer);
+  trace_end("sdl present", trace_t);
 
   SDL_Event e;
   while (SDL_PollEvent(&e)) {
@@ -98,6 +102,27 @@ void screen_flip(struct screen *s) {
   }
 }
 
+void screen_flip(struct screen *s) {
+  struct sdl_impl *impl = s->impl;
+  // Still present when clean: this also pumps SDL events
+  if (s->dirty) {
+    SDL_UpdateTexture(impl->texture, NULL, s->fb, s->stride);
+    s->dirty = false;
+  }
+  present(impl);
+}
+
+void screen_present_rows(struct screen *s, int y, int n) {
+  if (y < 0) { n += y; y = 0; }
+  if (y + n > s->height) n = s->height - y;
+  if (n <= 0) return;
+  struct sdl_impl *impl = s->impl;
+  SDL_Rect r = { .x = 0, .y = y, .w = s->width, .h = n };
+  SDL_UpdateTexture(impl->texture, &r, s->fb + y * s->stride, s->stride);
+  present(impl);
+}
+
 void screen_clear(struct screen* s) {
     memset(s->fb, 0, s->stride * s->height);
+    s->dirty = true;
 }
@@ -0,0 +1,90 @@
+#include "screen.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// XRGB8888. Stored as a word: on a little endian CPU the bytes land as B, G, R, X.
+static void write_span_xrgb8888(unsigned char *dst, const unsigned char *gray, int n) {
+    uint32_t *px = (uint32_t *)dst;
+    for (int i = 0; i < n; i++) {
+        px[i] = 0xFF000000u | (gray[i] * 0x010101u);
+    }
+}
+
+static void fill_span_xrgb8888(unsigned char *dst, unsigned char val, int n) {
+    uint32_t *px = (uint32_t *)dst;
+    const uint32_t v = 0xFF000000u | (val * 0x010101u);
+    for (int i = 0; i < n; i++) {
+        px[i] = v;
+    }
+}
+
+static inline uint16_t gray_to_rgb565(unsigned char val) {
+    uint16_t g = val >> 2;
+    uint16_t rb = val >> 3;
+    return (rb << 11) | (g << 5) | rb;
+}
+
+static void write_span_rgb565(unsigned char *dst, const unsigned char *gray, int n) {
+    uint16_t *px = (uint16_t *)dst;
+    for (int i = 0; i < n; i++) {
+        px[i] = gray_to_rgb565(gray[i]);
+    }
+}
+
+static void fill_span_rgb565(unsigned char *dst, unsigned char val, int n) {
+    uint16_t *px = (uint16_t *)dst;
+    const uint16_t v = gray_to_rgb565(val);
+    for (int i = 0; i < n; i++) {
+        px[i] = v;
+    }
+}
+
+bool screen_init_writers(struct screen* s) {
+    s->px_written = 0;
+    switch (s->bpp) {
+    case 32:
+        s->write_span = write_span_xrgb8888;
+        s->fill_span = fill_span_xrgb8888;
+        return true;
+    case 16:
+        s->write_span = write_span_rgb565;
+        s->fill_span = fill_span_rgb565;
+        return true;
+    default:
+        fprintf(stderr, "Unsupported pixel format: %d bpp\n", s->bpp);
+        s->write_span = NULL;
+        s->fill_span = NULL;
+        return false;
+    }
+}
+
+void screen_write_row(struct screen* s, int x, int y, const unsigned char* gray, int n) {
+    if (y < 0 || y >= s->height) return;
+    if (x < 0) {
+        gray -= x;
+        n += x;
+        x = 0;
+    }
+    if (x + n > s->width) n = s->width - x;
+    if (n <= 0) return;
+    s->dirty = true;
+    s->px_written += n;
+    s->write_span(s->fb + y * s->stride + x * (s->bpp / 8), gray, n);
+}
+
+void screen_fill_rect(struct screen* s, int x, int y, int w, int h, unsigned char val) {
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > s->width) w = s->width - x;
+    if (y + h > s->height) h = s->height - y;
+    if (w <= 0 || h <= 0) return;
+    s->dirty = true;
+    s->px_written += (size_t)w * h;
+
+    unsigned char *row = s->fb + y * s->stride + x * (s->bpp / 8);
+    for (int i = 0; i < h; i++, row += s->stride) {
+        s->fill_span(row, val, w);
+    }
+}
@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+"""
+Stand-in for the image server, to test picrt without the real one. Serves the
+JPEGs in a directory, round robin, with the same endpoints picrt uses:
+
+  /client_register                      -> client id
+  /client_cfg/<id>/<key>/<value>        -> "ok", or 404 for unknown keys
+  /get_next_img/<id>                    -> next image
+
+If the client asks for raw_format gray8 or rgb565, images are resized to the
+client's target_size and sent as raw frames (see raw_frame.h), deflated if it
+asks for raw_compression deflate. Raw frames need Pillow; without it the
+server refuses raw_format, and picrt keeps using JPEGs.
+
+Image downloads can be made to misbehave, to test how the client copes (see
+picrt-loadtest): slow to answer, slow to transfer, failing, cut short or
+stalled. Faults are picked at random per request; --seed makes runs
+repeatable.
+
+Usage: img_server.py [--port 5000] [--no-raw] [fault options] image_dir
+"""
+
+import argparse
+import itertools
+import os
+import random
+import struct
+import sys
+import threading
+import time
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+try:
+    from PIL import Image, ImageOps
+except ImportError:
+    Image = None
+
+RAW_FRAME_VERSION = 1
+RAW_FORMATS = {'gray8': 1, 'rgb565': 2}
+RAW_COMPRESSIONS = {'none': 0, 'deflate': 1}
+
+
+def raw_frame(path, cfg):
+    """ Converts a JPEG to a raw frame for a client, as raw_frame.h describes """
+    w, h = cfg['target_size']
+    img = ImageOps.fit(Image.open(path), (w, h))
+    if cfg['raw_format'] == 'gray8':
+        # Same curve as gray_conv: gamma is applied to luma
+        gamma = cfg['raw_gamma']
+        lut = [int(255.0 * pow(i / 255.0, gamma)) for i in range(256)]
+        pixels = img.convert('L').point(lut).tobytes()
+    else:
+        rgb = img.convert('RGB').tobytes()
+        pixels = bytearray()
+        for i in range(0, len(rgb), 3):
+            r, g, b = rgb[i], rgb[i + 1], rgb[i + 2]
+            pixels += struct.pack('<H', ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3))
+        pixels = bytes(pixels)
+
+    compression = cfg['raw_compression']
+    if compression == 'deflate':
+        pixels = zlib.compress(pixels, 6)
+    header = b'PRAW' + struct.pack('<BBBBHHI', RAW_FRAME_VERSION, RAW_FORMATS[cfg['raw_format']],
+                                   RAW_COMPRESSIONS[compression], 0, w, h, len(pixels))
+    return header + pixels
+
+
+class ImgServer(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, addr, img_dir, allow_raw, faults):
+        super().__init__(addr, Handler)
+        imgs = sorted(os.path.join(img_dir, f) for f in os.listdir(img_dir)
+                      if f.lower().endswith(('.jpg', '.jpeg')))
+        if not imgs:
+            raise ValueError(f'No JPEGs in {img_dir}')
+        self.imgs = itertools.cycle(imgs)
+        self.allow_raw = allow_raw and Image is not None
+        self.clients = {}
+        self.lock = threading.Lock()
+        self.faults = faults
+        self.rand = random.Random(faults.seed)
+        self.register_fails_left = faults.register_fail
+
+    def next_img(self):
+        with self.lock:
+            return next(self.imgs)
+
+    def roll(self, p):
+        """ True with probability p """
+        with self.lock:
+            return self.rand.random() < p
+
+    def uniform(self, a, b):
+        with self.lock:
+            return self.rand.uniform(a, b)
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, fmt, *args):
+        sys.stderr.write('%s\n' % (fmt % args))
+
+    def reply(self, code, body, content_type='text/plain'):
+        self.send_response(code)
+        self.send_header('Content-Type', content_type)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def send_img(self, body, content_type):
+        """ Sends an image, with whatever faults are configured """
+        srv = self.server
+        faults = srv.faults
+        delay = faults.latency_ms + srv.uniform(0, faults.jitter_ms)
+        time.sleep(delay / 1000)
+        if srv.roll(faults.error_rate):
+            return self.reply(500, b'injected error')
+
+        # Headers always announce the full image, so a cut or stall looks like a broken transfer
+        self.send_response(200)
+        self.send_header('Content-Type', content_type)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        end = len(body)
+        stall = srv.roll(faults.stall_rate)
+        if stall or srv.roll(faults.truncate_rate):
+            end = int(len(body) * srv.uniform(0, 1))
+
+        chunk = 16 * 1024
+        for i in range(0, end, chunk):
+            self.wfile.write(body[i:min(i + chunk, end)])
+            self.wfile.flush()
+            if faults.bandwidth_kbps:
+                time.sleep(chunk * 8 / (faults.bandwidth_kbps * 1000))
+        if stall:
+            time.sleep(faults.stall_sec)
+        if end < len(body):
+            self.close_connection = True
+
+    def do_GET(self):
+        parts = self.path.strip('/').split('/')
+        srv = self.server
+        if parts == ['client_register']:
+            with srv.lock:
+                fail = srv.register_fails_left > 0
+                srv.register_fails_left -= 1
+            if fail:
+                return self.reply(503, b'injected error')
+            with srv.lock:
+                client_id = str(len(srv.clients))
+                srv.clients[client_id] = {'target_size': (720, 576), 'raw_format': None,
+                                          'raw_compression': 'none', 'raw_gamma': 1.0}
+            return self.reply(200, client_id.encode())
+
+        if len(parts) == 4 and parts[0] == 'client_cfg' and parts[1] in srv.clients:
+            cfg = srv.clients[parts[1]]
+            key, val = parts[2], parts[3]
+            try:
+                if key == 'target_size':
+                    w, h = val.split('x')
+                    cfg[key] = (int(w), int(h))
+                elif key == 'embed_info_qr_code':
+                    pass
+                elif key == 'raw_format' and srv.allow_raw and val in RAW_FORMATS:
+                    cfg[key] = val
+                elif key == 'raw_compression' and srv.allow_raw and val in RAW_COMPRESSIONS:
+                    cfg[key] = val
+                elif key == 'raw_gamma' and srv.allow_raw:
+                    cfg[key] = float(val)
+                else:
+                    return self.reply(404, b'unsupported')
+            except ValueError:
+                return self.reply(400, b'bad value')
+            return self.reply(200, b'ok')
+
+        if len(parts) == 2 and parts[0] == 'get_next_img' and parts[1] in srv.clients:
+            cfg = srv.clients[parts[1]]
+            path = srv.next_img()
+            if cfg['raw_format']:
+                return self.send_img(raw_frame(path, cfg), 'application/octet-stream')
+            with open(path, 'rb') as f:
+                return self.send_img(f.read(), 'image/jpeg')
+
+        self.reply(404, b'not found')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Stand-in image server for picrt')
+    parser.add_argument('--port', type=int, default=5000)
+    parser.add_argument('--no-raw', action='store_true', help='Only serve JPEGs')
+    parser.add_argument('--quiet', action='store_true', help="Don't log requests")
+    faults = parser.add_argument_group('faults, for image downloads')
+    faults.add_argument('--latency-ms', type=float, default=0, help='Delay before answering')
+    faults.add_argument('--jitter-ms', type=float, default=0, help='Random extra delay, up to this')
+    faults.add_argument('--bandwidth-kbps', type=float, default=0, help='Transfer rate, 0 for no limit')
+    faults.add_argument('--error-rate', type=float, default=0, help='Fraction of requests that get a 500')
+    faults.add_argument('--truncate-rate', type=float, default=0,
+                        help='Fraction of images cut short, then the connection is closed')
+    faults.add_argument('--stall-rate', type=float, default=0,
+                        help='Fraction of images that stop mid transfer for --stall-sec')
+    faults.add_argument('--stall-sec', type=float, default=60)
+    faults.add_argument('--register-fail', type=int, default=0,
+                        help='Fail this many registrations before accepting one')
+    faults.add_argument('--seed', type=int, default=None, help='Seed for fault rolls')
+    parser.add_argument('img_dir')
+    args = parser.parse_args()
+    if Image is None and not args.no_raw:
+        print('Pillow not found, will only serve JPEGs', file=sys.stderr)
+    if args.quiet:
+        Handler.log_message = lambda *_: None
+    srv = ImgServer(('', args.port), args.img_dir, not args.no_raw, args)
+    print(f'Serving {args.img_dir} on port {args.port}', file=sys.stderr)
+    srv.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,203 @@
+#include "trace.h"
+
+#ifndef PICRT_NO_TRACE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct trace_event {
+    const char* name;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+    unsigned id;  // 0 for spans that nest, otherwise an async span
+};
+
+/**
+ * Only the owner thread writes to a ring. It publishes each event with a
+ * release store of head, so trace_dump can read the rings of running threads.
+ * Rings are never freed: threads may exit before the trace is dumped.
+ */
+struct trace_ring {
+    struct trace_ring* next;
+    const char* thread_name;
+    long tid;
+    size_t cap;                 // power of 2
+    atomic_size_t head;         // events ever written
+    struct trace_event events[];
+};
+
+static atomic_bool enabled;
+static size_t ring_cap;
+static uint64_t start_ns;
+
+// Only locked to add a ring, and to dump them
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring* rings;
+
+static __thread struct trace_ring* thread_ring;
+static __thread bool thread_ring_failed;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_init(size_t events_per_thread) {
+    size_t cap = 1;
+    while (cap < events_per_thread) cap *= 2;
+    ring_cap = cap;
+    start_ns = now_ns();
+    atomic_store(&enabled, true);
+}
+
+static struct trace_ring* get_ring(void) {
+    if (thread_ring || thread_ring_failed) {
+        return thread_ring;
+    }
+
+    struct trace_ring* ring = malloc(sizeof(struct trace_ring) + ring_cap * sizeof(struct trace_event));
+    if (!ring) {
+        fprintf(stderr, "bad alloc, won't trace this thread\n");
+        thread_ring_failed = true;
+        return NULL;
+    }
+    ring->thread_name = NULL;
+    ring->tid = syscall(SYS_gettid);
+    ring->cap = ring_cap;
+    atomic_init(&ring->head, 0);
+
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+
+    thread_ring = ring;
+    return ring;
+}
+
+void trace_thread_name(const char* name) {
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) return;
+    struct trace_ring* ring = get_ring();
+    if (ring) ring->thread_name = name;
+}
+
+uint64_t trace_begin(void) {
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) return 0;
+    return now_ns();
+}
+
+static void record(const char* name, uint64_t begin, unsigned id) {
+    if (!begin) return;
+    struct trace_ring* ring = get_ring();
+    if (!ring) return;
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct trace_event* ev = &ring->events[head & (ring->cap - 1)];
+    ev->name = name;
+    ev->begin_ns = begin;
+    ev->end_ns = now_ns();
+    ev->id = id;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void trace_end(const char* name, uint64_t begin) {
+    record(name, begin, 0);
+}
+
+void trace_end_async(const char* name, uint64_t begin, unsigned id) {
+    record(name, begin, id);
+}
+
+static double ts_us(uint64_t ns) {
+    return ns > start_ns ? (ns - start_ns) / 1e3 : 0;
+}
+
+static void dump_event(FILE* f, const struct trace_ring* ring, const struct trace_event* ev, bool* first) {
+    const int pid = getpid();
+    if (ev->id == 0) {
+        fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f}",
+                *first ? "" : ",", ev->name, pid, ring->tid, ts_us(ev->begin_ns),
+                (ev->end_ns - ev->begin_ns) / 1e3);
+    } else {
+        fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"async\",\"ph\":\"b\",\"id\":%u,\"pid\":%d,\"tid\":%ld,\"ts\":%.3f}",
+                *first ? "" : ",", ev->name, ev->id, pid, ring->tid, ts_us(ev->begin_ns));
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"async\",\"ph\":\"e\",\"id\":%u,\"pid\":%d,\"tid\":%ld,\"ts\":%.3f}",
+                ev->name, ev->id, pid, ring->tid, ts_us(ev->end_ns));
+    }
+    *first = false;
+}
+
+// Copies what's in the ring into events, returns how many are valid
+static size_t snapshot_ring(struct trace_ring* ring, struct trace_event* events) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t first = head > ring->cap ? head - ring->cap : 0;
+    for (size_t i = first; i < head; i++) {
+        events[i - first] = ring->events[i & (ring->cap - 1)];
+    }
+
+    // The owner may have overwritten the oldest events while we copied them, and may be
+    // writing event head_after right now, in the slot of event head_after - cap
+    size_t head_after = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t overwritten = head_after + 1 > ring->cap ? head_after + 1 - ring->cap : 0;
+    size_t skip = overwritten > first ? overwritten - first : 0;
+    if (skip >= head - first) {
+        return 0;
+    }
+    memmove(events, events + skip, (head - first - skip) * sizeof(struct trace_event));
+    return head - first - skip;
+}
+
+bool trace_dump(const char* path) {
+    if (!atomic_load(&enabled)) {
+        return false;
+    }
+
+    struct trace_event* events = malloc(ring_cap * sizeof(struct trace_event));
+    if (!events) {
+        fprintf(stderr, "bad alloc, can't dump trace\n");
+        return false;
+    }
+
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        free(events);
+        return false;
+    }
+
+    size_t total = 0;
+    bool first = true;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    pthread_mutex_lock(&rings_mutex);
+    for (struct trace_ring* ring = rings; ring; ring = ring->next) {
+        if (ring->thread_name) {
+            fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+                    first ? "" : ",", getpid(), ring->tid, ring->thread_name);
+            first = false;
+        }
+        size_t n = snapshot_ring(ring, events);
+        for (size_t i = 0; i < n; i++) {
+            dump_event(f, ring, &events[i], &first);
+        }
+        total += n;
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    fprintf(f, "\n]}\n");
+    free(events);
+
+    if (fclose(f) != 0) {
+        perror(path);
+        return false;
+    }
+    printf("Wrote %zu trace spans to %s\n", total, path);
+    return true;
+}
+
+#endif
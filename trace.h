@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Timeline of what each thread is doing, for one-off investigations. Spans
+ * are recorded into a ring per thread, so recording takes no locks; when a
+ * ring is full the oldest spans are overwritten. trace_dump writes the rings
+ * as Chrome trace_event JSON, which Perfetto (ui.perfetto.dev) or
+ * chrome://tracing can open.
+ *
+ * Off until trace_init is called: then trace_begin is a load and a branch,
+ * and trace_end does nothing. Build with -DPICRT_NO_TRACE to compile it all
+ * out.
+ *
+ * Usage:
+ *   uint64_t t = trace_begin();
+ *   ...
+ *   trace_end("decode", t);
+ *
+ * Span names must be string literals (or otherwise outlive the trace).
+ */
+
+#ifndef PICRT_NO_TRACE
+
+// Starts recording, keeping the last events_per_thread spans of each thread
+void trace_init(size_t events_per_thread);
+
+// Names the calling thread's track in the trace
+void trace_thread_name(const char* name);
+
+// Returns the current time, or 0 if tracing is off
+uint64_t trace_begin(void);
+
+// Records a span from begin to now. Spans of a thread must nest.
+void trace_end(const char* name, uint64_t begin);
+
+// Records a span that may overlap others in the same thread (eg concurrent
+// downloads). id tells apart overlapping spans with the same name.
+void trace_end_async(const char* name, uint64_t begin, unsigned id);
+
+/**
+ * Writes all recorded spans to path. Safe to call while other threads keep
+ * recording; spans overwritten during the dump are skipped. Returns false on
+ * error, or if tracing is off.
+ */
+bool trace_dump(const char* path);
+
+#else
+
+static inline void trace_init(size_t events_per_thread) { (void)events_per_thread; }
+static inline void trace_thread_name(const char* name) { (void)name; }
+static inline uint64_t trace_begin(void) { return 0; }
+static inline void trace_end(const char* name, uint64_t begin) { (void)name; (void)begin; }
+static inline void trace_end_async(const char* name, uint64_t begin, unsigned id) {
+    (void)name; (void)begin; (void)id;
+}
+static inline bool trace_dump(const char* path) { (void)path; return false; }
+
+#endif
@@ -0,0 +1,258 @@
+#include "transition.h"
+#include "mem_budget.h"
+#include "metrics.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TRANSITION_NEON 1
+#endif
+
+// The dissolve pattern repeats every this many rows; any more is indistinguishable on a CRT
+#define DISSOLVE_NOISE_ROWS 64
+
+#define LEVEL_MAX 256
+
+static size_t frames_size(int width, int height, int stripes) {
+    return 2 * (size_t)width * height + (size_t)width * stripes + (size_t)width * DISSOLVE_NOISE_ROWS;
+}
+
+bool transition_init(struct transition* t, int width, int height,
+                     enum transition_effect effect, unsigned duration_ms, unsigned fps,
+                     struct worker_pool* pool) {
+    memset(t, 0, sizeof(*t));
+    const int stripes = worker_pool_threads(pool);
+    const size_t sz = frames_size(width, height, stripes);
+    if (!mem_budget_reserve(MEM_FRAMES, sz)) {
+        fprintf(stderr, "Can't create %dx%d frames, don't fit in memory budget\n", width, height);
+        return false;
+    }
+
+    t->effect = effect;
+    t->duration_ms = duration_ms;
+    t->fps = fps > 0 ? fps : 1;
+    t->width = width;
+    t->height = height;
+    t->pool = pool;
+    t->stripes = stripes;
+    t->shown = calloc((size_t)width * height, 1);
+    t->next = calloc((size_t)width * height, 1);
+    t->rows = malloc((size_t)width * stripes);
+    t->noise = malloc((size_t)width * DISSOLVE_NOISE_ROWS);
+    if (!t->shown || !t->next || !t->rows || !t->noise) {
+        fprintf(stderr, "bad alloc\n");
+        transition_free(t);
+        return false;
+    }
+
+    // Uniform thresholds: a pixel switches once the level goes past its own
+    uint32_t seed = 2463534242u;
+    for (size_t i = 0; i < (size_t)width * DISSOLVE_NOISE_ROWS; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        t->noise[i] = seed >> 24;
+    }
+    return true;
+}
+
+void transition_free(struct transition* t) {
+    if (t->width > 0) {
+        mem_budget_release(MEM_FRAMES, frames_size(t->width, t->height, t->stripes));
+    }
+    free(t->shown);
+    free(t->next);
+    free(t->rows);
+    free(t->noise);
+    memset(t, 0, sizeof(*t));
+}
+
+const char* transition_effect_name(enum transition_effect e) {
+    switch (e) {
+    case TRANSITION_CUT: return "cut";
+    case TRANSITION_WIPE: return "wipe";
+    case TRANSITION_CROSSFADE: return "crossfade";
+    case TRANSITION_DISSOLVE: return "dissolve";
+    }
+    return "?";
+}
+
+// dst = (a * (256 - level) + b * level) / 256, exact at both ends
+static void blend_row(const unsigned char* a, const unsigned char* b, unsigned char* dst,
+                      int n, unsigned level) {
+    int i = 0;
+#ifdef TRANSITION_NEON
+    const uint16_t wa = LEVEL_MAX - level;
+    const uint16_t wb = level;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t va = vld1q_u8(a + i);
+        uint8x16_t vb = vld1q_u8(b + i);
+        uint16x8_t lo = vmulq_n_u16(vmovl_u8(vget_low_u8(va)), wa);
+        lo = vmlaq_n_u16(lo, vmovl_u8(vget_low_u8(vb)), wb);
+        uint16x8_t hi = vmulq_n_u16(vmovl_u8(vget_high_u8(va)), wa);
+        hi = vmlaq_n_u16(hi, vmovl_u8(vget_high_u8(vb)), wb);
+        vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = (a[i] * (LEVEL_MAX - level) + b[i] * level) >> 8;
+    }
+}
+
+// dst takes b where the pixel's threshold is below level, a elsewhere
+static void dissolve_row(const unsigned char* a, const unsigned char* b, const unsigned char* noise,
+                         unsigned char* dst, int n, unsigned level) {
+    int i = 0;
+#ifdef TRANSITION_NEON
+    const uint8x16_t vl = vdupq_n_u8(level);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t take_b = vcltq_u8(vld1q_u8(noise + i), vl);
+        vst1q_u8(dst + i, vbslq_u8(take_b, vld1q_u8(b + i), vld1q_u8(a + i)));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = noise[i] < level ? b[i] : a[i];
+    }
+}
+
+struct draw_job {
+    struct transition* t;
+    struct screen* s;
+    unsigned level;
+    int w;
+    int h;
+};
+
+// Draws a stripe of rows, in a worker thread. Spans are written straight to fb, as screen_write_row
+// would, without touching the screen's state.
+static void draw_stripe(void* usr, int stripe) {
+    const struct draw_job* job = usr;
+    const struct transition* t = job->t;
+    const struct screen* s = job->s;
+    const unsigned level = job->level;
+    const int wiped = job->h * level / LEVEL_MAX;
+    unsigned char* row = t->rows + (size_t)stripe * t->width;
+
+    const int y0 = job->h * stripe / t->stripes;
+    const int y1 = job->h * (stripe + 1) / t->stripes;
+    for (int y = y0; y < y1; y++) {
+        const unsigned char* a = t->shown + (size_t)y * t->width;
+        const unsigned char* b = t->next + (size_t)y * t->width;
+        const unsigned char* src;
+        if (level == 0 || level == LEVEL_MAX) {
+            src = level ? b : a;
+        } else if (t->effect == TRANSITION_CROSSFADE) {
+            blend_row(a, b, row, job->w, level);
+            src = row;
+        } else if (t->effect == TRANSITION_DISSOLVE) {
+            const unsigned char* noise = t->noise + (size_t)(y % DISSOLVE_NOISE_ROWS) * t->width;
+            dissolve_row(a, b, noise, row, job->w, level);
+            src = row;
+        } else {
+            src = y < wiped ? b : a;
+        }
+        s->write_span(s->fb + (size_t)y * s->stride, src, job->w);
+    }
+}
+
+void transition_draw(struct transition* t, struct screen* s, unsigned level) {
+    struct draw_job job = {
+        .t = t,
+        .s = s,
+        .level = level > LEVEL_MAX ? LEVEL_MAX : level,
+        .w = t->width < s->width ? t->width : s->width,
+        .h = t->height < s->height ? t->height : s->height,
+    };
+    if (job.w <= 0 || job.h <= 0) {
+        return;
+    }
+    s->dirty = true;
+    worker_pool_run(t->pool, draw_stripe, &job, t->stripes);
+    // Stripes write through s->write_span from worker threads, so they're counted here
+    s->px_written += (size_t)job.w * job.h;
+}
+
+static void present(struct screen* s) {
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t trace_t = trace_begin();
+    screen_flip(s);
+    trace_end("flip", trace_t);
+    metrics_observe_since(METRIC_FLIP, &t0);
+}
+
+// Writes and presents rows [from, to) of next
+static void wipe_rows(struct transition* t, struct screen* s, int from, int to) {
+    for (int y = from; y < to; y++) {
+        screen_write_row(s, 0, y, t->next + (size_t)y * t->width, t->width);
+    }
+    screen_present_rows(s, from, to - from);
+}
+
+static double ms_between(const struct timespec* t0, const struct timespec* t1) {
+    return (t1->tv_sec - t0->tv_sec) * 1e3 + (t1->tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+void transition_run(struct transition* t, struct screen* s, bool (*keep_going)(void)) {
+    const int h = t->height < s->height ? t->height : s->height;
+    const long frame_ns = 1000000000L / t->fps;
+    struct timespec start, deadline, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+
+    unsigned level = t->effect == TRANSITION_CUT || t->duration_ms == 0 ? LEVEL_MAX : 0;
+    int wiped = 0;
+    while (level < LEVEL_MAX && keep_going()) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const double elapsed_ms = ms_between(&start, &now);
+        level = elapsed_ms >= t->duration_ms ? LEVEL_MAX : (unsigned)(elapsed_ms * LEVEL_MAX / t->duration_ms);
+
+        uint64_t trace_t = trace_begin();
+        if (t->effect == TRANSITION_WIPE) {
+            // Only the newly revealed rows; the rest of the screen stays as is
+            const int to = h * level / LEVEL_MAX;
+            if (to > wiped) {
+                wipe_rows(t, s, wiped, to);
+                wiped = to;
+            }
+        } else {
+            transition_draw(t, s, level);
+            present(s);
+        }
+        trace_end("transition frame", trace_t);
+        if (level >= LEVEL_MAX) break;
+
+        // Absolute deadlines, so time spent drawing doesn't add up as drift. If we fell behind, don't
+        // try to catch up with a burst of frames.
+        deadline.tv_nsec += frame_ns;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec ||
+            (now.tv_sec == deadline.tv_sec && now.tv_nsec > deadline.tv_nsec)) {
+            deadline = now;
+        } else {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+        }
+    }
+
+    // Cut or interrupted: draw the whole new frame. A wipe already wrote it all, but still needs a
+    // flip so the back buffer holds it.
+    if (!(t->effect == TRANSITION_WIPE && wiped == h)) {
+        transition_draw(t, s, LEVEL_MAX);
+    }
+    present(s);
+
+    unsigned char* tmp = t->shown;
+    t->shown = t->next;
+    t->next = tmp;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "screen.h"
+
+struct worker_pool;
+
+/**
+ * Presents images with a transition effect. Images are composed off-screen,
+ * in 8 bit gray, and the transition then runs on its own clock: frames are
+ * drawn on absolute deadlines at a fixed rate, and the effect's progress
+ * follows the time elapsed, so a transition takes as long as configured no
+ * matter how big the image is or how busy the CPU is (a slow CPU shows fewer
+ * frames, not a slower effect).
+ *
+ * Crossfade and dissolve redraw the whole screen every frame; their blends
+ * run 8-16 pixels at a time with NEON on aarch64, and frames are drawn in row
+ * stripes across a worker pool. The wipe only writes the rows it reveals.
+ */
+enum transition_effect {
+    TRANSITION_CUT,        // Show the new image at once
+    TRANSITION_WIPE,       // Reveal the new image top to bottom
+    TRANSITION_CROSSFADE,  // Blend from the old image to the new one
+    TRANSITION_DISSOLVE,   // Switch pixels to the new image in random order
+};
+
+struct transition {
+    enum transition_effect effect;
+    unsigned duration_ms;
+    unsigned fps;
+    int width;
+    int height;
+    // Off-screen frames, width bytes per row. shown is what's on screen; the
+    // next image is composed into next.
+    unsigned char* shown;
+    unsigned char* next;
+    unsigned char* rows;   // Scratch rows for blends, one per stripe
+    unsigned char* noise;  // Dissolve thresholds, a tile of DISSOLVE_NOISE_ROWS rows
+    // Frames are drawn in a stripe per thread of the pool. NULL to draw in the caller's thread.
+    struct worker_pool* pool;
+    int stripes;
+};
+
+/**
+ * Allocates frames for a width x height screen, accounted as MEM_FRAMES.
+ * Returns false on bad alloc or if the frames don't fit in the memory budget.
+ * pool may be NULL; otherwise it must outlive the transition.
+ */
+bool transition_init(struct transition* t, int width, int height,
+                     enum transition_effect effect, unsigned duration_ms, unsigned fps,
+                     struct worker_pool* pool);
+void transition_free(struct transition* t);
+
+const char* transition_effect_name(enum transition_effect e);
+
+/**
+ * Draws the frame of the effect at level, from 0 (shown) to 256 (next), to
+ * the screen's back buffer. Doesn't present it.
+ */
+void transition_draw(struct transition* t, struct screen* s, unsigned level);
+
+/**
+ * Presents next on s with the configured effect, and makes it the shown
+ * frame. Blocks for the duration of the effect. If keep_going returns false
+ * (it's checked every frame), the effect is cut short and next is shown as is.
+ */
+void transition_run(struct transition* t, struct screen* s, bool (*keep_going)(void));
@@ -0,0 +1,139 @@
+#include "worker_pool.h"
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct worker_pool {
+    pthread_t* workers;
+    int n_workers;
+
+    // Protects everything below. Tasks are coarse (eg a stripe of a frame), so handing them out under
+    // a lock costs nothing noticeable.
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cv;  // A run started, or the pool is stopping
+    pthread_cond_t done_cv;  // The last task of a run finished
+    bool stop;
+    unsigned run_id;
+
+    // Current run
+    worker_pool_task task;
+    void* usr;
+    int n;
+    int next;     // Next task to hand out
+    int pending;  // Tasks not finished yet
+};
+
+// Runs tasks of the current run until there are none left. Called with the mutex held.
+static void run_tasks(struct worker_pool* p) {
+    while (p->next < p->n) {
+        const int i = p->next++;
+        worker_pool_task task = p->task;
+        void* usr = p->usr;
+        pthread_mutex_unlock(&p->mutex);
+        task(usr, i);
+        pthread_mutex_lock(&p->mutex);
+        if (--p->pending == 0) {
+            pthread_cond_signal(&p->done_cv);
+        }
+    }
+}
+
+static void* worker_thread(void* usr) {
+    struct worker_pool* p = usr;
+    trace_thread_name("worker");
+
+    pthread_mutex_lock(&p->mutex);
+    unsigned seen_run = p->run_id;
+    while (true) {
+        while (!p->stop && p->run_id == seen_run) {
+            pthread_cond_wait(&p->work_cv, &p->mutex);
+        }
+        if (p->stop) break;
+        seen_run = p->run_id;
+        run_tasks(p);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return NULL;
+}
+
+struct worker_pool* worker_pool_new(int threads) {
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+
+    struct worker_pool* p = calloc(1, sizeof(struct worker_pool));
+    if (!p) {
+        fprintf(stderr, "bad alloc\n");
+        return NULL;
+    }
+    p->workers = calloc(threads, sizeof(pthread_t));
+    if (!p->workers) {
+        fprintf(stderr, "bad alloc\n");
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->work_cv, NULL);
+    pthread_cond_init(&p->done_cv, NULL);
+
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&p->workers[i], NULL, worker_thread, p) != 0) {
+            perror("pthread_create, worker pool will be smaller");
+            break;
+        }
+        p->n_workers++;
+    }
+    return p;
+}
+
+void worker_pool_free(struct worker_pool* p) {
+    if (!p) {
+        return;
+    }
+    pthread_mutex_lock(&p->mutex);
+    p->stop = true;
+    pthread_cond_broadcast(&p->work_cv);
+    pthread_mutex_unlock(&p->mutex);
+    for (int i = 0; i < p->n_workers; i++) {
+        pthread_join(p->workers[i], NULL);
+    }
+    pthread_cond_destroy(&p->done_cv);
+    pthread_cond_destroy(&p->work_cv);
+    pthread_mutex_destroy(&p->mutex);
+    free(p->workers);
+    free(p);
+}
+
+int worker_pool_threads(const struct worker_pool* p) {
+    return p ? p->n_workers + 1 : 1;
+}
+
+void worker_pool_run(struct worker_pool* p, worker_pool_task task, void* usr, int n) {
+    if (!p || p->n_workers == 0 || n <= 1) {
+        for (int i = 0; i < n; i++) {
+            task(usr, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&p->mutex);
+    p->task = task;
+    p->usr = usr;
+    p->n = n;
+    p->next = 0;
+    p->pending = n;
+    p->run_id++;
+    pthread_cond_broadcast(&p->work_cv);
+
+    // The caller works too, instead of just waiting
+    run_tasks(p);
+    while (p->pending > 0) {
+        pthread_cond_wait(&p->done_cv, &p->mutex);
+    }
+    pthread_mutex_unlock(&p->mutex);
+}
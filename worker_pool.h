@@ -0,0 +1,29 @@
+#pragma once
+
+/**
+ * A few threads to split per-image work across cores, eg row stripes of a
+ * frame. worker_pool_run hands out tasks to the workers and the calling
+ * thread, and returns once all of them are done. Idle workers sleep on a
+ * condition variable, so a pool costs nothing while nothing runs.
+ *
+ * Tasks of a run must be independent. One run at a time: the pool is meant
+ * to be used by the render thread only.
+ */
+struct worker_pool;
+
+// Runs task number i (0 <= i < n) of a worker_pool_run
+typedef void (*worker_pool_task)(void* usr, int i);
+
+/**
+ * Starts threads - 1 workers (the caller is the last thread). threads <= 0
+ * uses one thread per online CPU. Returns NULL if no thread can be started;
+ * if only some can, the pool is smaller.
+ */
+struct worker_pool* worker_pool_new(int threads);
+void worker_pool_free(struct worker_pool* p);
+
+// Threads that run tasks, including the caller. 1 for a NULL pool.
+int worker_pool_threads(const struct worker_pool* p);
+
+// Runs task(usr, i) for i in [0, n), and waits for all of them. A NULL pool runs them in order.
+void worker_pool_run(struct worker_pool* p, worker_pool_task task, void* usr, int n);